@@ -22,6 +22,10 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* For sched_setaffinity() and friends. */
+#define _GNU_SOURCE
+#endif
 #ifdef TINYTEST_LOCAL
 #include "tinytest_local.h"
 #endif
@@ -29,7 +33,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 
 #ifndef NO_FORKING
 
@@ -38,7 +45,12 @@
 #else
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
 #include <unistd.h>
+#include <signal.h>
 #endif
 
 #if defined(__APPLE__) && defined(__ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__)
@@ -52,6 +64,48 @@
 
 #endif /* !NO_FORKING */
 
+#ifndef _WIN32
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <ctype.h>
+#endif
+
+#ifdef __linux__
+/* We can pin tests to CPUs for --pin. */
+#define HAVE_CPU_PINNING_
+#include <sched.h>
+#endif
+
+#if defined(__GLIBC__) && !defined(_WIN32)
+/* We can sample the stack for --profile. */
+#define HAVE_PROFILER_
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#if defined(TINYTEST_INTERPOSE_MALLOC) && defined(__GLIBC__) && \
+    !defined(NO_FORKING)
+/* We can replace malloc and friends for --malloc-sweep. */
+#define HAVE_MALLOC_SWEEP_
+#include <execinfo.h>
+#include <signal.h>
+#endif
+
+#if defined(TINYTEST_INTERPOSE_TIME) && defined(__GLIBC__)
+/* We can replace the clocks and sleeps for TT_VIRTUAL_TIME tests. */
+#define HAVE_VIRTUAL_TIME_
+#include <dlfcn.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#endif
+
 #ifndef __GNUC__
 #define __attribute__(x)
 #endif
@@ -68,12 +122,43 @@ static int n_skipped = 0; /**< Number of tests that have been skipped. */
 
 static int opt_forked = 0; /**< True iff we're called from inside a win32 fork*/
 static int opt_nofork = 0; /**< Suppress calls to fork() for debugging. */
-static int opt_verbosity = 1; /**< -==quiet,0==terse,1==normal,2==verbose */
+int tinytest_verbosity_ = 1; /**< -==quiet,0==terse,1==normal,2==verbose */
+static int opt_repeat = 1; /**< How many times to run each test. */
+static int cur_repetition = 0; /**< How many times we've run this test. */
+static int in_forked_child = 0; /**< True iff we're a child from fork(). */
+static int journal_has_resumed = 0; /**< True iff --journal is --resume. */
+static int opt_update_golden = 0; /**< Rewrite golden files, don't check. */
+static const char *opt_fixture_dir = NULL; /**< Where fixture images go. */
+#if !defined(NO_FORKING) && !defined(_WIN32)
+static int opt_served = 0; /**< True iff we're answering a --client request */
+#endif
 const char *verbosity_flag = "";
 
 const struct testlist_alias_t *cfg_aliases=NULL;
 
-enum outcome { SKIP=2, OK=1, FAIL=0 };
+#ifndef _WIN32
+/** Held while changing the current test's outcome or records, which tests
+ * can do from more than one thread. */
+static pthread_mutex_t test_state_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_TEST_STATE_() pthread_mutex_lock(&test_state_lock)
+#define UNLOCK_TEST_STATE_() pthread_mutex_unlock(&test_state_lock)
+#else
+#define LOCK_TEST_STATE_() ((void)0)
+#define UNLOCK_TEST_STATE_() ((void)0)
+#endif
+
+#ifndef _WIN32
+/** Return the time in seconds on a clock that only goes forward. */
+static double
+now_seconds_(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+enum outcome { PENDING=3, SKIP=2, OK=1, FAIL=0 };
 static enum outcome cur_test_outcome = FAIL;
 const char *cur_test_prefix = NULL; /**< prefix of the current test group */
 /** Name of the current test, if we haven't logged is yet. Used for --quiet */
@@ -86,408 +171,4337 @@ static char commandname[MAX_PATH+1];
 
 static void usage(struct testgroup_t *groups, int list_groups)
   __attribute__((noreturn));
+#ifndef _WIN32
+static void arena_reset_(void);
+#endif
+static void counters_reset_(void);
+static void counters_record_(void);
+#ifndef _WIN32
+static void counters_swap_(long *saved);
+#endif
 static int process_test_option(struct testgroup_t *groups, const char *test);
 
-static enum outcome
-testcase_run_bare_(const struct testcase_t *testcase)
+/* Everything that the current test has reported about itself, other than
+ * what it prints, is kept as a series of records in cur_records.  Each
+ * record is a type byte, the length of its body as an unsigned int in host
+ * order, and then the body.  A forked test sends its records, ending with
+ * a REC_OUTCOME, to its parent over outcome_pipe. */
+enum record_type {
+	REC_OUTCOME = 'O', /**< body: one byte, an enum outcome. */
+	REC_FAILURE = 'F', /**< body: unsigned int line, file NUL, msg NUL */
+	REC_METRIC = 'M', /**< body: double value, name NUL */
+	REC_VALUE = 'V' /**< body: key NUL, value NUL */
+};
+#define RECORD_HDR_LEN (1 + sizeof(unsigned int))
+static char *cur_records = NULL;
+static size_t cur_records_len = 0;
+static size_t cur_records_alloc = 0;
+#ifndef _WIN32
+/** In a forked test, where to send failures as soon as they happen, so
+ * that they reach the parent even if the test then crashes. */
+static int record_pipe_fd = -1;
+static int write_all_(int fd, const void *buf, size_t len);
+#endif
+
+/** Append a record to cur_records, with a body made of the fixedlen bytes
+ * at fixed, followed by the NUL-terminated strings s1 and s2 if they are
+ * provided. */
+static void
+add_record_(enum record_type type, const void *fixed, size_t fixedlen,
+	    const char *s1, const char *s2)
 {
-	void *env = NULL;
-	enum outcome outcome;
-	if (testcase->setup) {
-		env = testcase->setup->setup_fn(testcase);
-		if (!env)
-			return FAIL;
-		else if (env == (void*)TT_SKIP)
-			return SKIP;
+	size_t len1 = s1 ? strlen(s1)+1 : 0;
+	size_t len2 = s2 ? strlen(s2)+1 : 0;
+	unsigned int bodylen = (unsigned int)(fixedlen + len1 + len2);
+	char *cp;
+
+	LOCK_TEST_STATE_();
+	if (cur_records_len + RECORD_HDR_LEN + bodylen > cur_records_alloc) {
+		size_t alloc = cur_records_alloc ? cur_records_alloc : 256;
+		while (cur_records_len + RECORD_HDR_LEN + bodylen > alloc)
+			alloc *= 2;
+		if (!(cp = (char *) realloc(cur_records, alloc))) {
+			UNLOCK_TEST_STATE_();
+			return;
+		}
+		cur_records = cp;
+		cur_records_alloc = alloc;
 	}
+	cp = cur_records + cur_records_len;
+	*cp++ = (char)type;
+	memcpy(cp, &bodylen, sizeof(bodylen));
+	cp += sizeof(bodylen);
+	if (fixedlen)
+		memcpy(cp, fixed, fixedlen);
+	cp += fixedlen;
+	if (s1)
+		memcpy(cp, s1, len1);
+	cp += len1;
+	if (s2)
+		memcpy(cp, s2, len2);
+	cur_records_len += RECORD_HDR_LEN + bodylen;
+#ifndef _WIN32
+	if (type == REC_FAILURE && record_pipe_fd >= 0 &&
+	    write_all_(record_pipe_fd, cur_records, cur_records_len) == 0)
+		cur_records_len = 0;
+#endif
+	UNLOCK_TEST_STATE_();
+}
 
-	cur_test_outcome = OK;
-	testcase->fn(env);
-	outcome = cur_test_outcome;
+/** Look at the first record in the len bytes at buf.  If it is complete,
+ * return the total length of the record, and set *type and *body to its
+ * type and body.  Otherwise return 0. */
+static size_t
+parse_record_(const char *buf, size_t len, enum record_type *type,
+	      const char **body)
+{
+	unsigned int bodylen;
+	if (len < RECORD_HDR_LEN)
+		return 0;
+	memcpy(&bodylen, buf+1, sizeof(bodylen));
+	if (len - RECORD_HDR_LEN < bodylen)
+		return 0;
+	*type = (enum record_type) buf[0];
+	*body = buf + RECORD_HDR_LEN;
+	return RECORD_HDR_LEN + bodylen;
+}
 
-	if (testcase->setup) {
-		if (testcase->setup->cleanup_fn(testcase, env) == 0)
-			outcome = FAIL;
-	}
+/** Print the metrics and values in cur_records, for --verbose. */
+static void
+print_records_(void)
+{
+	size_t off = 0, n;
+	enum record_type type;
+	const char *body;
+	double d;
 
-	return outcome;
+	while ((n = parse_record_(cur_records+off, cur_records_len-off,
+		    &type, &body))) {
+		if (type == REC_METRIC) {
+			memcpy(&d, body, sizeof(d));
+			printf("  %s = %g\n", body+sizeof(d), d);
+		} else if (type == REC_VALUE) {
+			printf("  %s = %s\n", body, body+strlen(body)+1);
+		}
+		off += n;
+	}
 }
 
-#define MAGIC_EXITCODE 42
+/* With --journal, we append a line with the outcome and the name of each
+ * test to a file as soon as the test is done, so that if the whole run dies
+ * we can pick up where we left off with --resume.  We sync the journal to
+ * disk after every JOURNAL_SYNC_INTERVAL tests, and at exit. */
+#define JOURNAL_SYNC_INTERVAL 16
+static FILE *journal = NULL; /**< File that --journal appends to. */
+static int journal_unsynced = 0; /**< Entries not yet synced to disk. */
 
-#ifndef NO_FORKING
+/** A test outcome that we've read from a --resume journal. */
+struct journal_entry_ {
+	char *name;
+	enum outcome outcome;
+};
+static struct journal_entry_ *resumed = NULL; /**< Sorted by name. */
+static int n_resumed = 0;
 
-static enum outcome
-testcase_run_forked_(const struct testgroup_t *group,
-		     const struct testcase_t *testcase)
+static const char *const outcome_names_[] = { "FAIL", "OK", "SKIP" };
+
+static int
+compare_journal_entries_(const void *a, const void *b)
 {
-#ifdef _WIN32
-	/* Fork? On Win32?  How primitive!  We'll do what the smart kids do:
-	   we'll invoke our own exe (whose name we recall from the command
-	   line) with a command line that tells it to run just the test we
-	   want, and this time without forking.
+	return strcmp(((const struct journal_entry_ *)a)->name,
+		      ((const struct journal_entry_ *)b)->name);
+}
 
-	   (No, threads aren't an option.  The whole point of forking is to
-	   share no state between tests.)
-	 */
-	int ok;
-	char buffer[LONGEST_TEST_NAME+256];
-	STARTUPINFOA si;
-	PROCESS_INFORMATION info;
-	DWORD exitcode;
+/** Read the journal at path, for --resume.  A missing journal is the same
+ * as an empty one.  Return 0 on success, -1 on failure. */
+static int
+load_journal_(const char *path)
+{
+	FILE *f;
+	char line[LONGEST_TEST_NAME+16], *sp, *nl;
+	int n_alloc = 0, o;
 
-	if (!in_tinytest_main) {
-		printf("\nERROR.  On Windows, testcase_run_forked_ must be"
-		       " called from within tinytest_main.\n");
-		abort();
+	if (!(f = fopen(path, "r"))) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		return -1;
 	}
-	if (opt_verbosity>0)
-		printf("[forking] ");
+	while (fgets(line, sizeof(line), f)) {
+		/* Ignore a line that didn't get finished before a crash. */
+		if (!(nl = strchr(line, '\n')) || !(sp = strchr(line, ' ')))
+			continue;
+		*nl = *sp = '\0';
+		for (o = 0; o < 3 && strcmp(line, outcome_names_[o]); ++o)
+			;
+		if (o == 3)
+			continue;
+		if (n_resumed == n_alloc) {
+			struct journal_entry_ *r;
+			n_alloc = n_alloc ? n_alloc*2 : 64;
+			r = (struct journal_entry_ *) realloc(resumed,
+			    n_alloc * sizeof(struct journal_entry_));
+			if (!r)
+				break;
+			resumed = r;
+		}
+		if (!(resumed[n_resumed].name = strdup(sp+1)))
+			break;
+		resumed[n_resumed++].outcome = (enum outcome) o;
+	}
+	fclose(f);
+	if (n_resumed)
+		qsort(resumed, n_resumed, sizeof(struct journal_entry_),
+		    compare_journal_entries_);
+	return 0;
+}
 
-	snprintf(buffer, sizeof(buffer), "%s --RUNNING-FORKED %s %s%s",
-		 commandname, verbosity_flag, group->prefix, testcase->name);
+/** Flush the journal, and sync it to disk if we can. */
+static void
+sync_journal_(void)
+{
+	fflush(journal);
+#ifndef _WIN32
+	fsync(fileno(journal));
+#endif
+	journal_unsynced = 0;
+}
 
-	memset(&si, 0, sizeof(si));
-	memset(&info, 0, sizeof(info));
-	si.cb = sizeof(si);
+/** Add the outcome of the test called name to the journal. */
+static void
+append_journal_(const char *name, enum outcome outcome)
+{
+	fprintf(journal, "%s %s\n", outcome_names_[outcome], name);
+	fflush(journal);
+	if (++journal_unsynced >= JOURNAL_SYNC_INTERVAL)
+		sync_journal_();
+}
 
-	ok = CreateProcessA(commandname, buffer, NULL, NULL, 0,
-			   0, NULL, NULL, &si, &info);
-	if (!ok) {
-		printf("CreateProcess failed!\n");
-		return 0;
-	}
-	WaitForSingleObject(info.hProcess, INFINITE);
-	GetExitCodeProcess(info.hProcess, &exitcode);
-	CloseHandle(info.hProcess);
-	CloseHandle(info.hThread);
-	if (exitcode == 0)
-		return OK;
-	else if (exitcode == MAGIC_EXITCODE)
-		return SKIP;
+/** Return the entry for the test called name in the --resume journal, or
+ * NULL if there isn't one. */
+static struct journal_entry_ *
+find_resumed_(const char *name)
+{
+	struct journal_entry_ key;
+	if (!resumed)
+		return NULL;
+	key.name = (char *)name;
+	return (struct journal_entry_ *) bsearch(&key, resumed, n_resumed,
+	    sizeof(key), compare_journal_entries_);
+}
+
+#ifndef _WIN32
+
+/** Count and report the outcome of the test called name, which finished
+ * somewhere other than in testcase_run_one.  The test's records must be
+ * in cur_records. */
+static void
+report_outcome_(const char *fullname, enum outcome outcome)
+{
+	if (outcome == OK)
+		++n_ok;
+	else if (outcome == SKIP)
+		++n_skipped;
 	else
-		return FAIL;
-#else
-	int outcome_pipe[2];
-	pid_t pid;
-	(void)group;
+		++n_bad;
+	if (outcome == FAIL)
+		printf("\n  [%s FAILED]\n", fullname);
+	else if (tinytest_verbosity_>0)
+		printf("%s%s: %s\n", tinytest_verbosity_>1 ? "\n" : "",
+		    fullname, outcome_names_[outcome]);
+	if (tinytest_verbosity_>1)
+		print_records_();
+	if (journal)
+		append_journal_(fullname, outcome);
+}
 
-	if (pipe(outcome_pipe))
-		perror("opening pipe");
+/** A growing string. */
+struct strbuf_ {
+	char *s;
+	size_t len, alloc;
+};
 
-	if (opt_verbosity>0)
-		printf("[forking] ");
-	pid = fork();
-#ifdef FORK_BREAKS_GCOV
-	vproc_transaction_begin(0);
-#endif
-	if (!pid) {
-		/* child. */
-		int test_r, write_r;
-		char b[1];
-		close(outcome_pipe[0]);
-		test_r = testcase_run_bare_(testcase);
-		assert(0<=(int)test_r && (int)test_r<=2);
-		b[0] = "NYS"[test_r];
-		write_r = (int)write(outcome_pipe[1], b, 1);
-		if (write_r != 1) {
-			perror("write outcome to pipe");
-			exit(1);
-		}
-		exit(0);
-		return FAIL; /* unreachable */
-	} else {
-		/* parent */
-		int status, r;
-		char b[1];
-		/* Close this now, so that if the other side closes it,
-		 * our read fails. */
-		close(outcome_pipe[1]);
-		r = (int)read(outcome_pipe[0], b, 1);
-		if (r == 0) {
-			printf("[Lost connection!] ");
-			return FAIL;
-		} else if (r != 1) {
-			perror("read outcome from pipe");
+static void
+strbuf_printf_(struct strbuf_ *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0 || !b->s)
+		return;
+	if (b->len + n + 1 > b->alloc) {
+		size_t alloc = (b->len + n + 1) * 2;
+		char *s = (char *)realloc(b->s, alloc);
+		if (!s) {
+			free(b->s);
+			b->s = NULL;
+			return;
 		}
-		waitpid(pid, &status, 0);
-		close(outcome_pipe[0]);
-		return b[0]=='Y' ? OK : (b[0]=='S' ? SKIP : FAIL);
+		b->s = s;
+		b->alloc = alloc;
 	}
-#endif
+	va_start(ap, fmt);
+	vsnprintf(b->s + b->len, b->alloc - b->len, fmt, ap);
+	va_end(ap);
+	b->len += n;
 }
 
-#endif /* !NO_FORKING */
 
-int
-testcase_run_one(const struct testgroup_t *group,
-		 const struct testcase_t *testcase)
-{
+/* An async test starts some work with tt_async_begin() and returns.  After
+ * that, tinytest calls the test's callbacks from its own poll() loop as
+ * their file descriptors become ready or their timers expire, until the
+ * test calls tt_async_done() or runs out of time.  Async tests in the main
+ * process all wait in this loop together, so their waiting overlaps; while
+ * we run one test's callbacks, its outcome and records are swapped into the
+ * globals, so that failures are charged to the right test. */
+
+/** A file descriptor or timer that an async test is waiting for. */
+struct async_event_ {
+	int fd; /**< File descriptor to watch, or -1 for a timer. */
+	short events; /**< POLLIN and/or POLLOUT, for a file descriptor. */
+	double deadline; /**< When a timer fires. */
+	int pollidx; /**< Index in this poll()'s array, or -1. */
+	testasync_cb cb;
+	void *arg;
+	struct async_event_ *next;
+};
+
+struct tinytest_async_t {
+	const struct testgroup_t *group;
+	const struct testcase_t *testcase;
+	void *env; /**< From the test's setup function. */
+	double deadline; /**< When the test times out. */
+	const char *file; /**< Where the test called tt_async_begin(). */
+	int line;
+	int done; /**< True once the test is finished. */
+	int owner_waiting; /**< True iff testcase_run_bare_ will finish this. */
+	struct async_event_ *events;
+	/* The test's state, while its callbacks aren't running. */
 	enum outcome outcome;
+	char *records;
+	size_t records_len, records_alloc;
+	const char *prefix, *name;
+	long *counts; /**< One per counter. */
+	struct tinytest_async_t *next;
+};
 
-	if (testcase->flags & (TT_SKIP|TT_OFF_BY_DEFAULT)) {
-		if (opt_verbosity>0)
-			printf("%s%s: %s\n",
-			   group->prefix, testcase->name,
-			   (testcase->flags & TT_SKIP) ? "SKIPPED" : "DISABLED");
-		++n_skipped;
-		return SKIP;
-	}
+/** Async tests that are waiting in the loop. */
+static struct tinytest_async_t *async_pending = NULL;
+/** Async state started by the test function that's running right now. */
+static struct tinytest_async_t *cur_async = NULL;
+static const struct testgroup_t *running_group = NULL;
+static const struct testcase_t *running_testcase = NULL;
 
-	if (opt_verbosity>0 && !opt_forked) {
-		printf("%s%s: ", group->prefix, testcase->name);
-	} else {
-		if (opt_verbosity==0) printf(".");
-		cur_test_prefix = group->prefix;
-		cur_test_name = testcase->name;
-	}
+/** Exchange the current test's state with the state saved in a. */
+static void
+swap_async_state_(struct tinytest_async_t *a)
+{
+	enum outcome outcome = cur_test_outcome;
+	char *records = cur_records;
+	size_t records_len = cur_records_len;
+	size_t records_alloc = cur_records_alloc;
+	const char *prefix = cur_test_prefix, *name = cur_test_name;
 
-#ifndef NO_FORKING
-	if ((testcase->flags & TT_FORK) && !(opt_forked||opt_nofork)) {
-		outcome = testcase_run_forked_(group, testcase);
-	} else {
-#else
-	{
-#endif
-		outcome = testcase_run_bare_(testcase);
-	}
+	cur_test_outcome = a->outcome;
+	cur_records = a->records;
+	cur_records_len = a->records_len;
+	cur_records_alloc = a->records_alloc;
+	cur_test_prefix = a->prefix;
+	cur_test_name = a->name;
+	a->outcome = outcome;
+	a->records = records;
+	a->records_len = records_len;
+	a->records_alloc = records_alloc;
+	a->prefix = prefix;
+	a->name = name;
+	counters_swap_(a->counts);
+}
 
-	if (outcome == OK) {
-		++n_ok;
-		if (opt_verbosity>0 && !opt_forked)
-			puts(opt_verbosity==1?"OK":"");
-	} else if (outcome == SKIP) {
-		++n_skipped;
-		if (opt_verbosity>0 && !opt_forked)
-			puts("SKIPPED");
-	} else {
-		++n_bad;
-		if (!opt_forked)
-			printf("\n  [%s FAILED]\n", testcase->name);
-	}
+/** Take a test that has just returned from its function with async work
+ * outstanding, and put it in the loop. */
+static void
+park_async_(struct tinytest_async_t *a, void *env)
+{
+	a->env = env;
+	a->outcome = OK;
+	cur_test_prefix = running_group->prefix;
+	cur_test_name = running_testcase->name;
+	swap_async_state_(a);
+	a->next = async_pending;
+	async_pending = a;
+}
 
-	if (opt_forked) {
-		exit(outcome==OK ? 0 : (outcome==SKIP?MAGIC_EXITCODE : 1));
-		return 1; /* unreachable */
-	} else {
-		return (int)outcome;
+static void
+free_async_(struct tinytest_async_t *a)
+{
+	struct async_event_ *e, *next;
+	for (e = a->events; e; e = next) {
+		next = e->next;
+		free(e);
 	}
+	free(a->records);
+	free(a->counts);
+	free(a);
 }
 
-int
-tinytest_set_flag_(struct testgroup_t *groups, const char *arg, int set, unsigned long flag)
+/** Clean up after a finished async test that nobody is waiting for, and
+ * report its outcome. */
+static void
+finish_async_(struct tinytest_async_t *a)
 {
-	int i, j;
-	size_t length = LONGEST_TEST_NAME;
+	const struct testcase_t *testcase = a->testcase;
 	char fullname[LONGEST_TEST_NAME];
-	int found=0;
-	if (strstr(arg, ".."))
-		length = strstr(arg,"..")-arg;
-	for (i=0; groups[i].prefix; ++i) {
-		for (j=0; groups[i].cases[j].name; ++j) {
-			struct testcase_t *testcase = &groups[i].cases[j];
-			snprintf(fullname, sizeof(fullname), "%s%s",
-				 groups[i].prefix, testcase->name);
-			if (!flag) { /* Hack! */
-				printf("    %s", fullname);
-				if (testcase->flags & TT_OFF_BY_DEFAULT)
-					puts("   (Off by default)");
-				else if (testcase->flags & TT_SKIP)
-					puts("  (DISABLED)");
-				else
-					puts("");
-			}
-			if (!strncmp(fullname, arg, length)) {
-				if (set)
-					testcase->flags |= flag;
-				else
-					testcase->flags &= ~flag;
-				++found;
-			}
-		}
-	}
-	return found;
+	enum outcome outcome;
+
+	swap_async_state_(a);
+	if (testcase->setup &&
+	    testcase->setup->cleanup_fn(testcase, a->env) == 0)
+		cur_test_outcome = FAIL;
+	counters_record_();
+	outcome = cur_test_outcome;
+	snprintf(fullname, sizeof(fullname), "%s%s",
+		 a->group->prefix, testcase->name);
+	report_outcome_(fullname, outcome);
+	swap_async_state_(a);
+	free_async_(a);
 }
 
+/** Fail the async test a with msg, at the place it called
+ * tt_async_begin(), and finish it. */
 static void
-usage(struct testgroup_t *groups, int list_groups)
+fail_async_(struct tinytest_async_t *a, const char *msg)
 {
-	puts("Options are: [--verbose|--quiet|--terse] [--no-fork]");
-	puts("  Specify tests by name, or using a prefix ending with '..'");
-	puts("  To skip a test, prefix its name with a colon.");
-	puts("  To enable a disabled test, prefix its name with a plus.");
-	puts("  Use --list-tests for a list of tests.");
-	if (list_groups) {
-		puts("Known tests are:");
-		tinytest_set_flag_(groups, "..", 1, 0);
+	swap_async_state_(a);
+	tinytest_set_test_failed_();
+	tinytest_declare_("FAIL", a->file, a->line,
+	    tinytest_format_("%s", msg));
+	tinytest_record_failure_(a->file, a->line,
+	    tinytest_format_("%s", msg));
+	swap_async_state_(a);
+	a->done = 1;
+}
+
+/** Remove e from a's list of events. */
+static void
+unlink_event_(struct tinytest_async_t *a, struct async_event_ *e)
+{
+	struct async_event_ **ep;
+	for (ep = &a->events; *ep; ep = &(*ep)->next) {
+		if (*ep == e) {
+			*ep = e->next;
+			return;
+		}
 	}
-	exit(0);
 }
 
-static int
-process_test_alias(struct testgroup_t *groups, const char *test)
+/** Wait for the next thing that any pending async test is waiting for,
+ * or don't wait at all if !block, and run the callbacks that are ready.
+ * Then report on the tests that have finished. */
+static void
+run_async_once_(int block)
 {
-	int i, j, n, r;
-	for (i=0; cfg_aliases && cfg_aliases[i].name; ++i) {
+	struct tinytest_async_t *a, **ap;
+	struct async_event_ *e, *next;
+	struct pollfd *fds = NULL;
+	int n_fds = 0, timeout = 0;
+	double now, first_deadline = -1;
+
+	for (a = async_pending; a; a = a->next) {
+		if (first_deadline < 0 || a->deadline < first_deadline)
+			first_deadline = a->deadline;
+		for (e = a->events; e; e = e->next) {
+			e->pollidx = -1;
+			if (e->fd < 0) {
+				if (e->deadline < first_deadline)
+					first_deadline = e->deadline;
+			} else {
+				++n_fds;
+			}
+		}
+	}
+	if (n_fds && !(fds = (struct pollfd *)
+		calloc(n_fds, sizeof(struct pollfd)))) {
+		/* We can't wait for anything, so nothing would finish. */
+		for (a = async_pending; a; a = a->next) {
+			if (!a->done)
+				fail_async_(a, "no memory to wait for events");
+		}
+		goto finish;
+	}
+	n_fds = 0;
+	for (a = async_pending; a; a = a->next) {
+		for (e = a->events; e; e = e->next) {
+			if (e->fd < 0)
+				continue;
+			fds[n_fds].fd = e->fd;
+			fds[n_fds].events = e->events;
+			e->pollidx = n_fds++;
+		}
+	}
+	if (block && first_deadline >= 0) {
+		now = now_seconds_();
+		timeout = first_deadline > now ?
+		    (int)((first_deadline - now) * 1000) + 1 : 0;
+	}
+	if (poll(fds, n_fds, timeout) < 0 && errno != EINTR)
+		perror("poll");
+
+	now = now_seconds_();
+	for (a = async_pending; a; a = a->next) {
+		for (e = a->events; e && !a->done; e = next) {
+			next = e->next;
+			if (e->fd >= 0 ? (e->pollidx < 0 ||
+				!fds[e->pollidx].revents) : e->deadline > now)
+				continue;
+			unlink_event_(a, e);
+			swap_async_state_(a);
+			e->cb(a, e->fd, e->arg);
+			swap_async_state_(a);
+			free(e);
+		}
+		if (!a->done && a->deadline <= now)
+			fail_async_(a, "async test timed out");
+	}
+	free(fds);
+
+ finish:
+	for (ap = &async_pending; *ap; ) {
+		a = *ap;
+		if (a->done && !a->owner_waiting) {
+			*ap = a->next;
+			finish_async_(a);
+		} else {
+			ap = &a->next;
+		}
+	}
+}
+
+#endif
+
+#ifdef HAVE_CPU_PINNING_
+
+/* With --pin, we bind each test to a single CPU while it runs, taking CPUs
+ * in turn from pin_cpus, or from isolated_cpus for TT_ISOLATED tests.  We
+ * pin before calling the setup function, so that with the kernel's usual
+ * first-touch policy the test's memory comes from that CPU's NUMA node. */
+static int opt_pin = 0; /**< True iff we're pinning tests to CPUs. */
+static cpu_set_t pin_cpus; /**< CPUs for ordinary tests. */
+static cpu_set_t isolated_cpus; /**< CPUs reserved for TT_ISOLATED tests. */
+static cpu_set_t unpinned_cpus; /**< Our affinity before we pinned. */
+static int last_pin_cpu = -1, last_isolated_cpu = -1;
+static int cur_test_cpu = -1; /**< CPU for the current test, or -1. */
+
+/** Parse a list of CPUs like "0-3,6" into set.  Return 0 on success, -1 on
+ * failure. */
+static int
+parse_cpu_list_(const char *list, cpu_set_t *set)
+{
+	char *end;
+	long lo, hi;
+
+	CPU_ZERO(set);
+	while (*list) {
+		lo = hi = strtol(list, &end, 10);
+		if (end == list || lo < 0)
+			return -1;
+		if (*end == '-') {
+			list = end+1;
+			hi = strtol(list, &end, 10);
+			if (end == list || hi < lo)
+				return -1;
+		}
+		if (hi >= CPU_SETSIZE)
+			return -1;
+		for (; lo <= hi; ++lo)
+			CPU_SET(lo, set);
+		list = end;
+		if (*list == ',')
+			++list;
+		else if (*list)
+			return -1;
+	}
+	return 0;
+}
+
+/** Return the CPU after *last in set, wrapping around, and store it in
+ * *last.  Return -1 if set is empty. */
+static int
+next_cpu_(const cpu_set_t *set, int *last)
+{
+	int i, cpu;
+	for (i = 1; i <= CPU_SETSIZE; ++i) {
+		cpu = (*last + i) % CPU_SETSIZE;
+		if (CPU_ISSET(cpu, set))
+			return *last = cpu;
+	}
+	return -1;
+}
+
+/** Return the NUMA node that cpu belongs to, or -1 if we can't tell. */
+static int
+cpu_numa_node_(int cpu)
+{
+	char path[64];
+	DIR *dir;
+	struct dirent *ent;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if (!(dir = opendir(path)))
+		return -1;
+	while ((ent = readdir(dir))) {
+		if (!strncmp(ent->d_name, "node", 4) &&
+		    isdigit((unsigned char)ent->d_name[4])) {
+			node = atoi(ent->d_name+4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+/** Pick a CPU for testcase under --pin, and remember it in cur_test_cpu. */
+static void
+choose_test_cpu_(const struct testcase_t *testcase)
+{
+	if ((testcase->flags & TT_ISOLATED) && CPU_COUNT(&isolated_cpus))
+		cur_test_cpu = next_cpu_(&isolated_cpus, &last_isolated_cpu);
+	else
+		cur_test_cpu = next_cpu_(&pin_cpus, &last_pin_cpu);
+}
+
+/** Bind this process to cur_test_cpu, and record where we put it. */
+static void
+pin_test_(void)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cur_test_cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_setaffinity");
+		return;
+	}
+	tinytest_record_metric_("cpu", cur_test_cpu);
+	tinytest_record_metric_("numa_node", cpu_numa_node_(cur_test_cpu));
+}
+
+/** Undo pin_test_(). */
+static void
+unpin_test_(void)
+{
+	sched_setaffinity(0, sizeof(unpinned_cpus), &unpinned_cpus);
+}
+
+/** Set up pin_cpus and isolated_cpus for --pin, from the --pin and
+ * --isolate arguments (either of which may be NULL).  Return 0 on success,
+ * -1 on failure. */
+static int
+setup_pinning_(const char *pin_list, const char *isolate_list)
+{
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(unpinned_cpus), &unpinned_cpus) < 0) {
+		perror("sched_getaffinity");
+		return -1;
+	}
+	if (pin_list) {
+		if (parse_cpu_list_(pin_list, &pin_cpus) < 0) {
+			printf("Bad list of CPUs %s\n", pin_list);
+			return -1;
+		}
+	} else {
+		pin_cpus = unpinned_cpus;
+	}
+	CPU_ZERO(&isolated_cpus);
+	if (isolate_list && parse_cpu_list_(isolate_list, &isolated_cpus) < 0) {
+		printf("Bad list of CPUs %s\n", isolate_list);
+		return -1;
+	}
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		/* Otherwise we'd find out test by test, as
+		 * sched_setaffinity() failed. */
+		if ((CPU_ISSET(cpu, &pin_cpus) ||
+			CPU_ISSET(cpu, &isolated_cpus)) &&
+		    !CPU_ISSET(cpu, &unpinned_cpus)) {
+			printf("Can't pin tests to CPU %d: this process isn't "
+			    "allowed to run there.\n", cpu);
+			return -1;
+		}
+		if (CPU_ISSET(cpu, &isolated_cpus))
+			CPU_CLR(cpu, &pin_cpus);
+	}
+	if (!CPU_COUNT(&pin_cpus)) {
+		printf("No CPUs left to pin tests to.\n");
+		return -1;
+	}
+	opt_pin = 1;
+	return 0;
+}
+
+#endif /* HAVE_CPU_PINNING_ */
+
+#ifdef HAVE_PROFILER_
+
+/* With --profile, we sample the stack PROFILE_HZ times per second of CPU
+ * time while a test function runs, and then write the samples as "folded"
+ * stacks, ready for flamegraph.pl, to a file named after the test.  The
+ * timer's signal can land on any thread that's using CPU, as it will
+ * inside tt_run_threads(), so the handler claims each sample's slot with
+ * an atomic add. */
+#define PROFILE_HZ 250
+#define PROFILE_MAX_SAMPLES 16384
+#define PROFILE_MAX_DEPTH 32
+/** Frames at the top of each sample for our signal handler and for the
+ * kernel's signal trampoline. */
+#define PROFILE_SKIP_FRAMES 2
+/** Each sample is a frame count, then PROFILE_MAX_DEPTH frames. */
+#define PROFILE_SAMPLE_LEN (PROFILE_MAX_DEPTH+1)
+
+static const char *opt_profile_dir = NULL; /**< Where --profile writes. */
+static void **profile_samples = NULL;
+static volatile sig_atomic_t profile_n_samples = 0;
+static volatile sig_atomic_t profile_n_dropped = 0;
+static struct sigaction profile_old_action;
+
+static void
+profile_handler_(int sig)
+{
+	void **sample;
+	int saved_errno = errno, i;
+	(void)sig;
+	if ((i = __sync_fetch_and_add(&profile_n_samples, 1)) >=
+	    PROFILE_MAX_SAMPLES) {
+		__sync_fetch_and_add(&profile_n_dropped, 1);
+		return;
+	}
+	sample = profile_samples + i * PROFILE_SAMPLE_LEN;
+	sample[0] = (void *)(size_t) backtrace(sample+1, PROFILE_MAX_DEPTH);
+	errno = saved_errno;
+}
+
+/** Start sampling the stack.  Return 0 on success, -1 on failure. */
+static int
+profile_start_(void)
+{
+	struct sigaction sa;
+	struct itimerval itv;
+
+	if (!profile_samples) {
+		void *frame[1];
+		profile_samples = (void **) malloc(sizeof(void *) *
+		    PROFILE_MAX_SAMPLES * PROFILE_SAMPLE_LEN);
+		if (!profile_samples)
+			return -1;
+		/* The first call to backtrace() can load libgcc, which isn't
+		 * safe from a signal handler.  Get that out of the way. */
+		backtrace(frame, 1);
+	}
+	profile_n_samples = profile_n_dropped = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = profile_handler_;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, &profile_old_action) < 0)
+		return -1;
+	memset(&itv, 0, sizeof(itv));
+	itv.it_interval.tv_usec = 1000000 / PROFILE_HZ;
+	itv.it_value = itv.it_interval;
+	return setitimer(ITIMER_PROF, &itv, NULL);
+}
+
+static int
+profile_compare_samples_(const void *a_, const void *b_)
+{
+	void * const *a = (void * const *) a_;
+	void * const *b = (void * const *) b_;
+	size_t na = (size_t) a[0], nb = (size_t) b[0];
+	if (na != nb)
+		return na < nb ? -1 : 1;
+	return memcmp(a+1, b+1, na * sizeof(void *));
+}
+
+/** Find the function name in a line of output from backtrace_symbols(), as
+ * best we can: set *len to its length and return a pointer to it.  Frames
+ * in functions without an exported name, like static functions, can't be
+ * told apart, so they're all named after their object file, as in
+ * "prog(?)".  Frames we know nothing about are just "?". */
+static const char *
+profile_frame_name_(const char *symbol, size_t *len)
+{
+	const char *paren = strchr(symbol, '('), *start;
+	if (paren && paren[1] != '+' && paren[1] != ')') {
+		start = paren+1;
+		*len = strcspn(start, "+)");
+	} else if (paren) {
+		for (start = paren; start > symbol && start[-1] != '/'; --start)
+			;
+		*len = paren - start + 1;
+	} else {
+		start = "?";
+		*len = 1;
+	}
+	return start;
+}
+
+/** Return a newly allocated string holding the stack in sample as a
+ * folded stack: function names from the root to the leaf, separated by
+ * semicolons.  Return NULL if we can't. */
+static char *
+profile_fold_sample_(void **sample)
+{
+	int depth = (int)(size_t) sample[0], j;
+	char **symbols, *result, *cp;
+	const char *name;
+	size_t len, total = 1;
+
+	if (depth <= PROFILE_SKIP_FRAMES)
+		return NULL;
+	if (!(symbols = backtrace_symbols(sample+1, depth)))
+		return NULL;
+	for (j = PROFILE_SKIP_FRAMES; j < depth; ++j) {
+		profile_frame_name_(symbols[j], &len);
+		total += len + 3;
+	}
+	if ((cp = result = (char *) malloc(total))) {
+		for (j = depth-1; j >= PROFILE_SKIP_FRAMES; --j) {
+			name = profile_frame_name_(symbols[j], &len);
+			memcpy(cp, name, len);
+			cp += len;
+			if (name[len-1] == '(') {
+				*cp++ = '?';
+				*cp++ = ')';
+			}
+			if (j > PROFILE_SKIP_FRAMES)
+				*cp++ = ';';
+		}
+		*cp = '\0';
+	}
+	free(symbols);
+	return result;
+}
+
+/** A folded stack, and how many samples we saw it in. */
+struct profile_stack_ {
+	char *stack;
+	int count;
+};
+
+static int
+profile_compare_stacks_(const void *a, const void *b)
+{
+	return strcmp(((const struct profile_stack_ *)a)->stack,
+		      ((const struct profile_stack_ *)b)->stack);
+}
+
+/** Stop sampling the stack, and write what we got to a file named after
+ * the test in opt_profile_dir. */
+static void
+profile_stop_(const struct testgroup_t *group,
+	      const struct testcase_t *testcase)
+{
+	struct itimerval itv;
+	char path[LONGEST_TEST_NAME+256], *cp;
+	struct profile_stack_ *stacks;
+	FILE *out;
+	int i, n, n_stacks = 0, count;
+
+	memset(&itv, 0, sizeof(itv));
+	setitimer(ITIMER_PROF, &itv, NULL);
+	sigaction(SIGPROF, &profile_old_action, NULL);
+	/* The handler counts the samples it dropped here too. */
+	if (profile_n_samples > PROFILE_MAX_SAMPLES)
+		profile_n_samples = PROFILE_MAX_SAMPLES;
+
+	n = snprintf(path, sizeof(path), "%s/", opt_profile_dir);
+	if (n < 0)
+		n = 0;
+	else if ((size_t)n >= sizeof(path))
+		n = sizeof(path) - 1;
+	cp = path + n;
+	snprintf(cp, sizeof(path) - (cp - path), "%s%s.folded",
+		 group->prefix, testcase->name);
+	for (; *cp; ++cp) {
+		if (*cp == '/')
+			*cp = '.';
+	}
+	if (!(out = fopen(path, "w"))) {
+		perror(path);
+		return;
+	}
+
+	/* Symbolize each distinct stack once, then merge the stacks that
+	 * differ only in where they were inside each function. */
+	qsort(profile_samples, profile_n_samples,
+	    sizeof(void *) * PROFILE_SAMPLE_LEN, profile_compare_samples_);
+	stacks = (struct profile_stack_ *)
+	    malloc(sizeof(struct profile_stack_) * (profile_n_samples+1));
+	for (i = 0; stacks && i < profile_n_samples; i += count) {
+		void **sample = profile_samples + i * PROFILE_SAMPLE_LEN;
+		for (count = 1; i + count < profile_n_samples &&
+			 !profile_compare_samples_(sample,
+			     sample + count * PROFILE_SAMPLE_LEN); ++count)
+			;
+		if ((stacks[n_stacks].stack = profile_fold_sample_(sample)))
+			stacks[n_stacks++].count = count;
+	}
+	if (stacks) {
+		qsort(stacks, n_stacks, sizeof(struct profile_stack_),
+		    profile_compare_stacks_);
+		for (i = 0; i < n_stacks; i = n) {
+			count = 0;
+			for (n = i; n < n_stacks &&
+				 !strcmp(stacks[i].stack, stacks[n].stack); ++n)
+				count += stacks[n].count;
+			fprintf(out, "%s %d\n", stacks[i].stack, count);
+		}
+		for (i = 0; i < n_stacks; ++i)
+			free(stacks[i].stack);
+		free(stacks);
+	}
+	fclose(out);
+
+	tinytest_record_value_("profile", path);
+	if (profile_n_dropped)
+		tinytest_record_metric_("profile_dropped_samples",
+		    profile_n_dropped);
+}
+
+#endif /* HAVE_PROFILER_ */
+
+#ifdef HAVE_MALLOC_SWEEP_
+
+/* With --malloc-sweep, we check how a test copes when malloc fails.  When
+ * the test makes its Kth allocation, we fork; the child fails that
+ * allocation and runs the rest of the test, while the parent waits for it,
+ * lets the allocation succeed, and goes on to allocation K+1.  So each
+ * child starts from where the last one left off, instead of replaying the
+ * whole test from the beginning.  We report the values of K where the
+ * child crashed, hung, or left more allocations live than the real run
+ * did.  Only allocations made by the test's own thread count. */
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+extern void *__libc_memalign(size_t, size_t);
+
+/** How long a child may run before we decide it's hung. */
+#define SWEEP_CHILD_TIMEOUT 10
+/** Most bad allocations we describe for one test. */
+#define SWEEP_MAX_REPORTS 16
+/** Most distinct call sites we count. */
+#define SWEEP_MAX_SITES 4096
+
+static unsigned long opt_malloc_sweep = 0; /**< Most allocations to fail. */
+
+enum sweep_state_ { SWEEP_OFF, SWEEP_DRIVING, SWEEP_CHILD };
+static enum sweep_state_ sweep_state = SWEEP_OFF;
+static pthread_t sweep_thread; /**< The thread whose allocations count. */
+static int sweep_busy = 0; /**< True while we're forking or waiting. */
+/** True while the test runs other threads, which a child wouldn't have. */
+static int sweep_paused = 0;
+static unsigned long sweep_n_allocs = 0; /**< Allocations so far. */
+static unsigned long sweep_fail_at = 0; /**< In a child, which to fail. */
+/** Allocations not yet freed, from any thread.  Only changed with
+ * SWEEP_LIVE_ADD_, since any thread can allocate. */
+static long sweep_live = 0;
+#define SWEEP_LIVE_ADD_(n) ((void) __sync_fetch_and_add(&sweep_live, (n)))
+static long sweep_live_at_start = 0;
+/** True iff cur_records was allocated when the test started: a child that
+ * records a failure allocates it, and that isn't the test's leak. */
+static int sweep_records_at_start = 0;
+static int sweep_pipe[2] = { -1, -1 }; /**< Children report leaks here. */
+static void *sweep_sites[SWEEP_MAX_SITES]; /**< Call sites, hashed. */
+static int sweep_n_sites = 0;
+
+/** An allocation that the test didn't survive failing. */
+struct sweep_report_ {
+	unsigned long k;
+	void *site;
+	int signal; /**< What killed the child, or 0 if it exited. */
+	long leaked; /**< How many allocations the child left live. */
+};
+static char sweep_test_name[LONGEST_TEST_NAME]; /**< The test we sweep. */
+static struct sweep_report_ *sweep_reports = NULL;
+static unsigned long sweep_n_reports = 0, sweep_reports_alloc = 0;
+
+/** Note the call site of an allocation, for counting. */
+static void
+sweep_note_site_(void *site)
+{
+	unsigned i = (unsigned)(((unsigned long)site >> 4) % SWEEP_MAX_SITES);
+	while (sweep_sites[i] && sweep_sites[i] != site)
+		i = (i + 1) % SWEEP_MAX_SITES;
+	if (!sweep_sites[i] && sweep_n_sites < SWEEP_MAX_SITES - 1) {
+		sweep_sites[i] = site;
+		++sweep_n_sites;
+	}
+}
+
+/** Decide what to do about an allocation that the test is making from
+ * site.  Return 1 if it should fail. */
+static int
+sweep_should_fail_(void *site)
+{
+	struct sweep_report_ *rep;
+	long leaked = 0;
+	pid_t pid;
+	int status, devnull;
+
+	if (sweep_state == SWEEP_OFF || sweep_busy || sweep_paused ||
+	    !pthread_equal(pthread_self(), sweep_thread))
+		return 0;
+	++sweep_n_allocs;
+	if (sweep_state == SWEEP_CHILD)
+		return sweep_n_allocs == sweep_fail_at;
+	sweep_note_site_(site);
+	if (sweep_n_allocs > opt_malloc_sweep)
+		return 0;
+
+	sweep_busy = 1;
+	fflush(stdout);
+	if ((pid = fork()) < 0) {
+		sweep_busy = 0;
+		return 0;
+	} else if (!pid) {
+		sweep_state = SWEEP_CHILD;
+		sweep_fail_at = sweep_n_allocs;
+		record_pipe_fd = -1; /* This child's failures don't count. */
+		sweep_busy = 0;
+		close(sweep_pipe[0]);
+		if ((devnull = open("/dev/null", O_WRONLY)) >= 0) {
+			dup2(devnull, 1);
+			close(devnull);
+		}
+		alarm(SWEEP_CHILD_TIMEOUT);
+		return 1;
+	}
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	if (WIFEXITED(status) &&
+	    read(sweep_pipe[0], &leaked, sizeof(leaked)) != sizeof(leaked))
+		leaked = 0;
+	/* We don't know how much a successful run leaks until it's over,
+	 * so remember any child that leaked at all. */
+	if (WIFSIGNALED(status) || leaked > 0) {
+		if (sweep_n_reports == sweep_reports_alloc) {
+			sweep_reports_alloc = sweep_reports_alloc ?
+			    sweep_reports_alloc*2 : 64;
+			rep = (struct sweep_report_ *) __libc_realloc(
+			    sweep_reports, sweep_reports_alloc * sizeof(*rep));
+			if (!rep) {
+				sweep_busy = 0;
+				return 0;
+			}
+			sweep_reports = rep;
+		}
+		rep = &sweep_reports[sweep_n_reports++];
+		rep->k = sweep_n_allocs;
+		rep->site = site;
+		rep->signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+		rep->leaked = leaked;
+	}
+	sweep_busy = 0;
+	return 0;
+}
+
+void *
+malloc(size_t n)
+{
+	void *p;
+	if (sweep_should_fail_(__builtin_return_address(0))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((p = __libc_malloc(n)))
+		SWEEP_LIVE_ADD_(1);
+	return p;
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	void *p;
+	if (sweep_should_fail_(__builtin_return_address(0))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((p = __libc_calloc(n, size)))
+		SWEEP_LIVE_ADD_(1);
+	return p;
+}
+
+void *
+realloc(void *ptr, size_t n)
+{
+	void *p;
+	if (sweep_should_fail_(__builtin_return_address(0))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	p = __libc_realloc(ptr, n);
+	if (p && !ptr)
+		SWEEP_LIVE_ADD_(1);
+	else if (!p && ptr && !n)
+		SWEEP_LIVE_ADD_(-1);
+	return p;
+}
+
+/* The aligned allocators have to count too, since free() can't tell their
+ * blocks from the others. */
+void *
+memalign(size_t align, size_t n)
+{
+	void *p;
+	if (sweep_should_fail_(__builtin_return_address(0))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((p = __libc_memalign(align, n)))
+		SWEEP_LIVE_ADD_(1);
+	return p;
+}
+
+void *
+aligned_alloc(size_t align, size_t n)
+{
+	void *p;
+	if (sweep_should_fail_(__builtin_return_address(0))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((p = __libc_memalign(align, n)))
+		SWEEP_LIVE_ADD_(1);
+	return p;
+}
+
+int
+posix_memalign(void **out, size_t align, size_t n)
+{
+	void *p;
+	if (!align || (align & (align-1)) || align % sizeof(void *))
+		return EINVAL;
+	if (sweep_should_fail_(__builtin_return_address(0)))
+		return ENOMEM;
+	if (!(p = __libc_memalign(align, n)))
+		return ENOMEM;
+	SWEEP_LIVE_ADD_(1);
+	*out = p;
+	return 0;
+}
+
+void
+free(void *ptr)
+{
+	if (ptr)
+		SWEEP_LIVE_ADD_(-1);
+	__libc_free(ptr);
+}
+
+/** Start counting the current test's allocations, if we're sweeping. */
+static void
+sweep_start_(const struct testgroup_t *group,
+	     const struct testcase_t *testcase)
+{
+	if (!opt_malloc_sweep || pipe(sweep_pipe) < 0)
+		return;
+	snprintf(sweep_test_name, sizeof(sweep_test_name), "%s%s",
+	    group->prefix, testcase->name);
+	memset(sweep_sites, 0, sizeof(sweep_sites));
+	sweep_n_sites = 0;
+	sweep_n_reports = 0;
+	sweep_n_allocs = 0;
+	sweep_thread = pthread_self();
+	sweep_live_at_start = __sync_fetch_and_add(&sweep_live, 0);
+	sweep_records_at_start = (cur_records != NULL);
+	sweep_state = SWEEP_DRIVING;
+}
+
+/** Fail the test because failing its allocation k, made from site, made
+ * it do what.  The failure is recorded against the test's name and k, not
+ * against a line of this file. */
+static void
+sweep_fail_(unsigned long k, const char *site, char *what)
+{
+	char *msg = tinytest_format_("%s: failing allocation %lu (at %s) "
+	    "made the test %s", sweep_test_name, k, site, what ? what : "fail");
+	tinytest_set_test_failed_();
+	printf("\n  FAIL %s", msg);
+	tinytest_record_failure_(sweep_test_name, (int)k, msg);
+	free(what);
+}
+
+/** Stop counting the current test's allocations.  In a child, report how
+ * many allocations were left over, and exit; in the parent, report the
+ * allocations that the test didn't handle failing, and return how many
+ * there were. */
+static unsigned long
+sweep_finish_(void)
+{
+	long leaked = __sync_fetch_and_add(&sweep_live, 0) -
+	    sweep_live_at_start -
+	    ((cur_records != NULL) - sweep_records_at_start);
+	unsigned long i, n_bad = 0;
+	char **site, *msg;
+
+	if (sweep_state == SWEEP_OFF)
+		return 0;
+	if (sweep_state == SWEEP_CHILD) {
+		(void) write(sweep_pipe[1], &leaked, sizeof(leaked));
+		_exit(0);
+	}
+	sweep_state = SWEEP_OFF;
+	close(sweep_pipe[0]);
+	close(sweep_pipe[1]);
+
+	tinytest_record_metric_("malloc_sweep.allocations",
+	    sweep_n_allocs);
+	tinytest_record_metric_("malloc_sweep.call_sites", sweep_n_sites);
+
+	/* Describe the crashes first, and then the leaks.  A child is only
+	 * leaky if it leaked more than the real run. */
+	for (i = 0; i < 2*sweep_n_reports; ++i) {
+		struct sweep_report_ *rep = &sweep_reports[i % sweep_n_reports];
+		if (!rep->signal != (i >= sweep_n_reports) ||
+		    (!rep->signal && rep->leaked <= leaked))
+			continue;
+		if (++n_bad > SWEEP_MAX_REPORTS)
+			continue;
+		site = backtrace_symbols(&rep->site, 1);
+		if (rep->signal == SIGALRM)
+			msg = tinytest_format_("hang");
+		else if (rep->signal)
+			msg = tinytest_format_("die with signal %d",
+			    rep->signal);
+		else
+			msg = tinytest_format_("leak %ld allocations",
+			    rep->leaked - leaked);
+		sweep_fail_(rep->k, site ? site[0] : "?", msg);
+		free(site);
+	}
+	if (n_bad > SWEEP_MAX_REPORTS) {
+		msg = tinytest_format_("%s: ... and %lu more bad allocations",
+		    sweep_test_name, n_bad - SWEEP_MAX_REPORTS);
+		printf("\n  FAIL %s", msg);
+		tinytest_record_failure_(sweep_test_name, 0, msg);
+	}
+	return n_bad;
+}
+
+#endif /* HAVE_MALLOC_SWEEP_ */
+
+#ifdef HAVE_VIRTUAL_TIME_
+
+/* Virtual time, for TT_VIRTUAL_TIME tests.  While one of those is running,
+ * anything that would sleep or wait for a timeout adds the time it would
+ * have waited to vt_offset_ns and returns at once.  The monotonic clocks
+ * always read vt_offset_ns ahead of the real ones, even after the test, so
+ * that they never go backwards.  The wall clocks only read ahead during a
+ * virtual test, by however much it has moved them.  We look up the real
+ * functions with dlsym(), the first time we need them. */
+
+static int vt_active = 0; /**< True while a TT_VIRTUAL_TIME test runs. */
+static long long vt_offset_ns = 0; /**< Virtual time added so far, ever. */
+static long long vt_offset_at_start = 0; /**< vt_offset_ns at test start. */
+
+static int (*real_clock_gettime)(clockid_t, struct timespec *);
+static time_t (*real_time)(time_t *);
+static int (*real_gettimeofday)(struct timeval *, void *);
+static unsigned int (*real_sleep)(unsigned int);
+static int (*real_usleep)(useconds_t);
+static int (*real_nanosleep)(const struct timespec *, struct timespec *);
+static int (*real_clock_nanosleep)(clockid_t, int, const struct timespec *,
+    struct timespec *);
+static int (*real_poll)(struct pollfd *, nfds_t, int);
+static int (*real_epoll_wait)(int, struct epoll_event *, int, int);
+
+/** Look up the real versions of the functions we replace. */
+static void
+vt_init_(void)
+{
+#define VT_LOOKUP_(fn) \
+	(*(void **)&real_##fn = dlsym(RTLD_NEXT, #fn))
+	VT_LOOKUP_(time);
+	VT_LOOKUP_(gettimeofday);
+	VT_LOOKUP_(sleep);
+	VT_LOOKUP_(usleep);
+	VT_LOOKUP_(nanosleep);
+	VT_LOOKUP_(clock_nanosleep);
+	VT_LOOKUP_(poll);
+	VT_LOOKUP_(epoll_wait);
+	VT_LOOKUP_(clock_gettime);
+#undef VT_LOOKUP_
+}
+#define VT_REAL_(fn) (real_##fn ? real_##fn : (vt_init_(), real_##fn))
+
+/** Move virtual time forward by ns nanoseconds. */
+static void
+vt_advance_(long long ns)
+{
+	if (ns > 0)
+		__sync_fetch_and_add(&vt_offset_ns, ns);
+}
+
+/** Return true iff clk is a clock that only goes forward. */
+static int
+vt_is_monotonic_clock_(clockid_t clk)
+{
+	return clk == CLOCK_MONOTONIC
+#ifdef CLOCK_MONOTONIC_RAW
+	    || clk == CLOCK_MONOTONIC_RAW
+#endif
+#ifdef CLOCK_MONOTONIC_COARSE
+	    || clk == CLOCK_MONOTONIC_COARSE
+#endif
+#ifdef CLOCK_BOOTTIME
+	    || clk == CLOCK_BOOTTIME
+#endif
+	    ;
+}
+
+/** Return true iff clk is a clock that virtual time moves. */
+static int
+vt_is_wall_clock_(clockid_t clk)
+{
+	return clk == CLOCK_REALTIME || vt_is_monotonic_clock_(clk)
+#ifdef CLOCK_REALTIME_COARSE
+	    || clk == CLOCK_REALTIME_COARSE
+#endif
+	    ;
+}
+
+/** Return how far ahead of the real clock clk virtual time puts it. */
+static long long
+vt_offset_(clockid_t clk)
+{
+	long long off = __sync_fetch_and_add(&vt_offset_ns, 0);
+	if (vt_is_monotonic_clock_(clk))
+		return off;
+	else if (vt_active && vt_is_wall_clock_(clk))
+		return off - vt_offset_at_start;
+	else
+		return 0;
+}
+
+int
+clock_gettime(clockid_t clk, struct timespec *ts)
+{
+	long long off;
+	int r = VT_REAL_(clock_gettime)(clk, ts);
+	if (r == 0 && (off = vt_offset_(clk))) {
+		off += ts->tv_nsec;
+		ts->tv_sec += (time_t)(off / 1000000000);
+		ts->tv_nsec = (long)(off % 1000000000);
+	}
+	return r;
+}
+
+time_t
+time(time_t *t)
+{
+	struct timespec ts;
+	if (!vt_active)
+		return VT_REAL_(time)(t);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (t)
+		*t = ts.tv_sec;
+	return ts.tv_sec;
+}
+
+int
+gettimeofday(struct timeval *tv, void *tz)
+{
+	struct timespec ts;
+	int r = VT_REAL_(gettimeofday)(tv, tz);
+	if (!vt_active || r < 0)
+		return r;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+	return 0;
+}
+
+unsigned int
+sleep(unsigned int sec)
+{
+	if (!vt_active)
+		return VT_REAL_(sleep)(sec);
+	vt_advance_(sec * 1000000000LL);
+	return 0;
+}
+
+int
+usleep(useconds_t usec)
+{
+	if (!vt_active)
+		return VT_REAL_(usleep)(usec);
+	vt_advance_(usec * 1000LL);
+	return 0;
+}
+
+int
+nanosleep(const struct timespec *req, struct timespec *rem)
+{
+	if (!vt_active || !req)
+		return VT_REAL_(nanosleep)(req, rem);
+	vt_advance_(req->tv_sec * 1000000000LL + req->tv_nsec);
+	if (rem)
+		rem->tv_sec = rem->tv_nsec = 0;
+	return 0;
+}
+
+int
+clock_nanosleep(clockid_t clk, int flags, const struct timespec *req,
+		struct timespec *rem)
+{
+	struct timespec now;
+	if (!vt_active || !req || !vt_is_wall_clock_(clk))
+		return VT_REAL_(clock_nanosleep)(clk, flags, req, rem);
+	if (flags & TIMER_ABSTIME) {
+		clock_gettime(clk, &now);
+		vt_advance_((req->tv_sec - now.tv_sec) * 1000000000LL +
+		    (req->tv_nsec - now.tv_nsec));
+	} else {
+		vt_advance_(req->tv_sec * 1000000000LL + req->tv_nsec);
+		if (rem)
+			rem->tv_sec = rem->tv_nsec = 0;
+	}
+	return 0;
+}
+
+int
+poll(struct pollfd *fds, nfds_t n, int timeout_msec)
+{
+	int r;
+	if (!vt_active || timeout_msec <= 0)
+		return VT_REAL_(poll)(fds, n, timeout_msec);
+	/* Don't wait: if nothing is ready now, time is up, even if another
+	 * thread or process was about to make something ready. */
+	if ((r = VT_REAL_(poll)(fds, n, 0)) == 0)
+		vt_advance_(timeout_msec * 1000000LL);
+	return r;
+}
+
+int
+epoll_wait(int epfd, struct epoll_event *events, int max, int timeout_msec)
+{
+	int r;
+	if (!vt_active || timeout_msec <= 0)
+		return VT_REAL_(epoll_wait)(epfd, events, max, timeout_msec);
+	if ((r = VT_REAL_(epoll_wait)(epfd, events, max, 0)) == 0)
+		vt_advance_(timeout_msec * 1000000LL);
+	return r;
+}
+
+void
+tinytest_advance_time_(long msec)
+{
+	if (vt_active)
+		vt_advance_(msec * 1000000LL);
+	else
+		tt_fail_msg("tt_advance_time() only works in TT_VIRTUAL_TIME "
+		    "tests");
+}
+
+#else
+
+void
+tinytest_advance_time_(long msec)
+{
+	(void)msec;
+	tt_fail_msg("tt_advance_time() needs tinytest built with "
+	    "TINYTEST_INTERPOSE_TIME");
+}
+
+#endif /* HAVE_VIRTUAL_TIME_ */
+
+static enum outcome
+testcase_run_bare_(const struct testgroup_t *group,
+		   const struct testcase_t *testcase)
+{
+	void *env = NULL;
+	enum outcome outcome;
+#ifdef HAVE_PROFILER_
+	int profiling = 0;
+#endif
+#ifdef HAVE_CPU_PINNING_
+	if (cur_test_cpu >= 0)
+		pin_test_();
+#endif
+#ifndef _WIN32
+	if (!async_pending)
+		arena_reset_();
+#endif
+	counters_reset_();
+#ifdef HAVE_VIRTUAL_TIME_
+	if (testcase->flags & TT_VIRTUAL_TIME) {
+		vt_offset_at_start = __sync_fetch_and_add(&vt_offset_ns, 0);
+		vt_active = 1;
+	}
+#endif
+#ifdef HAVE_MALLOC_SWEEP_
+	sweep_start_(group, testcase);
+#endif
+	if (testcase->setup) {
+		env = testcase->setup->setup_fn(testcase);
+		if (!env) {
+			outcome = FAIL;
+			goto done;
+		} else if (env == (void*)TT_SKIP) {
+			outcome = SKIP;
+			goto done;
+		}
+	}
+
+	cur_test_outcome = OK;
+#ifndef _WIN32
+	running_group = group;
+	running_testcase = testcase;
+	cur_async = NULL;
+#endif
+#ifdef HAVE_PROFILER_
+	if (opt_profile_dir)
+		profiling = (profile_start_() == 0);
+#endif
+	testcase->fn(env);
+#ifdef HAVE_PROFILER_
+	if (profiling)
+		profile_stop_(group, testcase);
+#endif
+#ifndef _WIN32
+	if (cur_async) {
+		struct tinytest_async_t *a = cur_async, **ap;
+		cur_async = NULL;
+		if (!a->done) {
+			/* In the main process, we can let the test finish
+			 * while others run.  Anywhere else, we wait for it
+			 * here. */
+			a->owner_waiting = !in_tinytest_main ||
+			    in_forked_child || opt_repeat > 1 ||
+			    (testcase->flags & TT_VIRTUAL_TIME);
+			park_async_(a, env);
+			if (!a->owner_waiting) {
+				outcome = PENDING;
+				goto done;
+			}
+			while (!a->done)
+				run_async_once_(1);
+			for (ap = &async_pending; *ap != a; ap = &(*ap)->next)
+				;
+			*ap = a->next;
+			swap_async_state_(a);
+		}
+		free_async_(a);
+	}
+#else
+	(void)group;
+#endif
+	outcome = cur_test_outcome;
+
+	if (testcase->setup) {
+		if (testcase->setup->cleanup_fn(testcase, env) == 0)
+			outcome = FAIL;
+	}
+
+ done:
+	if (outcome != PENDING)
+		counters_record_();
+#ifdef HAVE_VIRTUAL_TIME_
+	vt_active = 0;
+#endif
+#ifdef HAVE_MALLOC_SWEEP_
+	if (sweep_finish_() && outcome != PENDING)
+		outcome = FAIL;
+#endif
+#ifdef HAVE_CPU_PINNING_
+	if (cur_test_cpu >= 0)
+		unpin_test_();
+#endif
+	return outcome;
+}
+
+#define MAGIC_EXITCODE 42
+
+#ifndef NO_FORKING
+
+#ifndef _WIN32
+/** Write all of buf to fd.  Return 0 on success, -1 on failure. */
+static int
+write_all_(int fd, const void *buf, size_t len)
+{
+	const char *cp = (const char *) buf;
+	while (len) {
+		ssize_t r = write(fd, cp, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		cp += r;
+		len -= (size_t)r;
+	}
+	return 0;
+}
+#endif
+
+static enum outcome
+testcase_run_forked_(const struct testgroup_t *group,
+		     const struct testcase_t *testcase)
+{
+#ifdef _WIN32
+	/* Fork? On Win32?  How primitive!  We'll do what the smart kids do:
+	   we'll invoke our own exe (whose name we recall from the command
+	   line) with a command line that tells it to run just the test we
+	   want, and this time without forking.
+
+	   (No, threads aren't an option.  The whole point of forking is to
+	   share no state between tests.)
+	 */
+	int ok;
+	char buffer[LONGEST_TEST_NAME+256];
+	STARTUPINFOA si;
+	PROCESS_INFORMATION info;
+	DWORD exitcode;
+
+	if (!in_tinytest_main) {
+		printf("\nERROR.  On Windows, testcase_run_forked_ must be"
+		       " called from within tinytest_main.\n");
+		abort();
+	}
+	if (tinytest_verbosity_>0 && !cur_repetition)
+		printf("[forking] ");
+
+	snprintf(buffer, sizeof(buffer), "%s --RUNNING-FORKED %s %s%s",
+		 commandname, verbosity_flag, group->prefix, testcase->name);
+
+	memset(&si, 0, sizeof(si));
+	memset(&info, 0, sizeof(info));
+	si.cb = sizeof(si);
+
+	ok = CreateProcessA(commandname, buffer, NULL, NULL, 0,
+			   0, NULL, NULL, &si, &info);
+	if (!ok) {
+		printf("CreateProcess failed!\n");
+		return 0;
+	}
+	WaitForSingleObject(info.hProcess, INFINITE);
+	GetExitCodeProcess(info.hProcess, &exitcode);
+	CloseHandle(info.hProcess);
+	CloseHandle(info.hThread);
+	if (exitcode == 0)
+		return OK;
+	else if (exitcode == MAGIC_EXITCODE)
+		return SKIP;
+	else
+		return FAIL;
+#else
+	int outcome_pipe[2];
+	pid_t pid;
+
+	if (pipe(outcome_pipe))
+		perror("opening pipe");
+
+	if (tinytest_verbosity_>0 && !cur_repetition)
+		printf("[forking] ");
+	pid = fork();
+#ifdef FORK_BREAKS_GCOV
+	vproc_transaction_begin(0);
+#endif
+	if (!pid) {
+		/* child. */
+		int test_r;
+		char b[1];
+		close(outcome_pipe[0]);
+		in_forked_child = 1;
+		async_pending = NULL; /* Those belong to our parent. */
+		record_pipe_fd = outcome_pipe[1];
+		test_r = testcase_run_bare_(group, testcase);
+		assert(0<=(int)test_r && (int)test_r<=2);
+		b[0] = (char)test_r;
+		add_record_(REC_OUTCOME, b, 1, NULL, NULL);
+		if (write_all_(outcome_pipe[1], cur_records,
+			cur_records_len) < 0) {
+			perror("write outcome to pipe");
+			exit(1);
+		}
+		exit(0);
+		return FAIL; /* unreachable */
+	} else {
+		/* parent */
+		int status, r;
+		char *buf = NULL;
+		size_t len = 0, alloc = 0, off = 0, n;
+		int got_outcome = 0;
+		enum outcome outcome = FAIL;
+		enum record_type type;
+		const char *body;
+		/* Close this now, so that if the other side closes it,
+		 * our read fails. */
+		close(outcome_pipe[1]);
+		/* Read records until we see the outcome, which comes last;
+		 * add the rest to our own records for the test. */
+		while (!got_outcome) {
+			if (len == alloc) {
+				char *newbuf;
+				alloc = alloc ? alloc*2 : 4096;
+				if (!(newbuf = (char *) realloc(buf, alloc)))
+					break;
+				buf = newbuf;
+			}
+			r = (int)read(outcome_pipe[0], buf+len, alloc-len);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				perror("read outcome from pipe");
+			if (r <= 0)
+				break;
+			len += r;
+			while (!got_outcome &&
+			       (n = parse_record_(buf+off, len-off,
+				    &type, &body))) {
+				if (type == REC_OUTCOME) {
+					outcome = (enum outcome) body[0];
+					got_outcome = 1;
+				} else {
+					add_record_(type, body,
+					    n - RECORD_HDR_LEN, NULL, NULL);
+				}
+				off += n;
+			}
+		}
+		free(buf);
+		if (!got_outcome)
+			printf("[Lost connection!] ");
+		waitpid(pid, &status, 0);
+		close(outcome_pipe[0]);
+		return outcome;
+	}
+#endif
+}
+
+#endif /* !NO_FORKING */
+
+int
+testcase_run_one(const struct testgroup_t *group,
+		 const struct testcase_t *testcase)
+{
+	enum outcome outcome = FAIL;
+	char fullname[LONGEST_TEST_NAME];
+	struct journal_entry_ *entry;
+
+	cur_records_len = 0;
+	if (testcase->flags & (TT_SKIP|TT_OFF_BY_DEFAULT)) {
+		if (tinytest_verbosity_>0)
+			printf("%s%s: %s\n",
+			   group->prefix, testcase->name,
+			   (testcase->flags & TT_SKIP) ? "SKIPPED" : "DISABLED");
+		++n_skipped;
+		return SKIP;
+	}
+
+	if ((resumed || journal) && !opt_forked)
+		snprintf(fullname, sizeof(fullname), "%s%s",
+			 group->prefix, testcase->name);
+	if (resumed && !opt_forked && (entry = find_resumed_(fullname))) {
+		outcome = entry->outcome;
+		if (outcome == OK)
+			++n_ok;
+		else if (outcome == SKIP)
+			++n_skipped;
+		else
+			++n_bad;
+		if (tinytest_verbosity_>0 || outcome == FAIL)
+			printf("%s: %s (resumed)\n", fullname,
+			    outcome == FAIL ? "FAILED" :
+			    outcome_names_[outcome]);
+		else if (tinytest_verbosity_==0)
+			printf(".");
+		if (journal && !journal_has_resumed)
+			append_journal_(fullname, outcome);
+		return (int)outcome;
+	}
+
+#ifdef HAVE_CPU_PINNING_
+	if (opt_pin)
+		choose_test_cpu_(testcase);
+#endif
+
+	if (tinytest_verbosity_>0 && !opt_forked) {
+		printf("%s%s: ", group->prefix, testcase->name);
+	} else {
+		if (tinytest_verbosity_==0) printf(".");
+		cur_test_prefix = group->prefix;
+		cur_test_name = testcase->name;
+	}
+
+	/* With --stress-repeat, run the test again and again until it fails
+	 * or we've run it enough times. */
+	for (cur_repetition = 0; cur_repetition < opt_repeat;
+	     ++cur_repetition) {
+		cur_records_len = 0;
+#ifndef NO_FORKING
+		if ((testcase->flags & TT_FORK) && !(opt_forked||opt_nofork)) {
+			outcome = testcase_run_forked_(group, testcase);
+		} else {
+#else
+		{
+#endif
+			outcome = testcase_run_bare_(group, testcase);
+		}
+		if (outcome != OK)
+			break;
+	}
+	if (outcome == FAIL && opt_repeat > 1)
+		tinytest_record_metric_("failed_repetition", cur_repetition+1);
+
+	if (outcome == PENDING) {
+		if (tinytest_verbosity_>0 && !opt_forked)
+			puts(tinytest_verbosity_==1 ?
+			    "[pending]" : "\n  [pending]");
+		return (int)outcome;
+	}
+
+	if (outcome == OK) {
+		++n_ok;
+		if (tinytest_verbosity_>0 && !opt_forked)
+			puts(tinytest_verbosity_==1?"OK":"");
+	} else if (outcome == SKIP) {
+		++n_skipped;
+		if (tinytest_verbosity_>0 && !opt_forked)
+			puts("SKIPPED");
+	} else {
+		++n_bad;
+		if (!opt_forked)
+			printf("\n  [%s FAILED]\n", testcase->name);
+	}
+
+	if (tinytest_verbosity_>1 && !opt_forked)
+		print_records_();
+	if (journal && !opt_forked)
+		append_journal_(fullname, outcome);
+
+	if (opt_forked) {
+		exit(outcome==OK ? 0 : (outcome==SKIP?MAGIC_EXITCODE : 1));
+		return 1; /* unreachable */
+	} else {
+		return (int)outcome;
+	}
+}
+
+int
+tinytest_set_flag_(struct testgroup_t *groups, const char *arg, int set, unsigned long flag)
+{
+	int i, j;
+	size_t length = LONGEST_TEST_NAME;
+	char fullname[LONGEST_TEST_NAME];
+	int found=0;
+	if (strstr(arg, ".."))
+		length = strstr(arg,"..")-arg;
+	for (i=0; groups[i].prefix; ++i) {
+		for (j=0; groups[i].cases[j].name; ++j) {
+			struct testcase_t *testcase = &groups[i].cases[j];
+			snprintf(fullname, sizeof(fullname), "%s%s",
+				 groups[i].prefix, testcase->name);
+			if (!flag) { /* Hack! */
+				printf("    %s", fullname);
+				if (testcase->flags & TT_OFF_BY_DEFAULT)
+					puts("   (Off by default)");
+				else if (testcase->flags & TT_SKIP)
+					puts("  (DISABLED)");
+				else
+					puts("");
+			}
+			if (!strncmp(fullname, arg, length)) {
+				if (set)
+					testcase->flags |= flag;
+				else
+					testcase->flags &= ~flag;
+				++found;
+			}
+		}
+	}
+	return found;
+}
+
+static void
+usage(struct testgroup_t *groups, int list_groups)
+{
+	puts("Options are: [--verbose|--quiet|--terse] [--no-fork]");
+	puts("  Specify tests by name, or using a prefix ending with '..'");
+	puts("  To skip a test, prefix its name with a colon.");
+	puts("  To enable a disabled test, prefix its name with a plus.");
+	puts("  Use --list-tests for a list of tests.");
+#if !defined(NO_FORKING) && !defined(_WIN32)
+	puts("  Use --serve=SOCKET to keep running and take requests from");
+	puts("  --client=SOCKET, which sends along the rest of its arguments.");
+	puts("  Use --coordinate=SOCKET to hand out tests to processes run");
+	puts("  with --worker=SOCKET, and --local-workers=N to start N of");
+	puts("  them.");
+	puts("  A SOCKET can be a path, or HOST:PORT for TCP; an empty HOST");
+	puts("  means this machine only, and * means every address.");
+#endif
+	puts("  Use --stress-repeat=N to run each test up to N times,");
+	puts("  until it fails.");
+	puts("  Use --update-golden to rewrite golden files to match the");
+	puts("  output of the tests, instead of checking against them.");
+	puts("  Use --fixture-dir=DIR to keep fixture images in DIR instead");
+	puts("  of $TMPDIR.");
+	puts("  Use --journal=FILE to log each test's outcome to FILE as it");
+	puts("  finishes, and --resume=FILE to skip the tests that FILE says");
+	puts("  are done.");
+#ifdef HAVE_CPU_PINNING_
+	puts("  Use --pin or --pin=CPULIST to run each test on a single");
+	puts("  CPU, and --isolate=CPULIST to keep those CPUs for");
+	puts("  TT_ISOLATED tests.");
+#endif
+#ifdef HAVE_MALLOC_SWEEP_
+	puts("  Use --malloc-sweep or --malloc-sweep=N to check what happens");
+	puts("  when each of a test's first N allocations fails.");
+#endif
+#ifdef HAVE_PROFILER_
+	puts("  Use --profile=DIR to write a folded stack profile of each");
+	puts("  test into DIR.");
+#endif
+	if (list_groups) {
+		puts("Known tests are:");
+		tinytest_set_flag_(groups, "..", 1, 0);
+	}
+	exit(0);
+}
+
+static int
+process_test_alias(struct testgroup_t *groups, const char *test)
+{
+	int i, j, n, r;
+	for (i=0; cfg_aliases && cfg_aliases[i].name; ++i) {
 		if (!strcmp(cfg_aliases[i].name, test)) {
 			n = 0;
 			for (j = 0; cfg_aliases[i].tests[j]; ++j) {
 				r = process_test_option(groups, cfg_aliases[i].tests[j]);
 				if (r<0)
 					return -1;
-				n += r;
+				n += r;
+			}
+			return n;
+		}
+	}
+	printf("No such test alias as @%s!",test);
+	return -1;
+}
+
+static int
+process_test_option(struct testgroup_t *groups, const char *test)
+{
+	int flag = TT_ENABLED_;
+	int n = 0;
+	if (test[0] == '@') {
+		return process_test_alias(groups, test + 1);
+	} else if (test[0] == ':') {
+		++test;
+		flag = TT_SKIP;
+	} else if (test[0] == '+') {
+		++test;
+		++n;
+		if (!tinytest_set_flag_(groups, test, 0, TT_OFF_BY_DEFAULT)) {
+			printf("No such test as %s!\n", test);
+			return -1;
+		}
+	} else {
+		++n;
+	}
+	if (!tinytest_set_flag_(groups, test, 1, flag)) {
+		printf("No such test as %s!\n", test);
+		return -1;
+	}
+	return n;
+}
+
+void
+tinytest_set_aliases(const struct testlist_alias_t *aliases)
+{
+	cfg_aliases = aliases;
+}
+
+#if !defined(NO_FORKING) && !defined(_WIN32)
+
+/** Largest request that we'll accept from a --client. */
+#define MAX_SERVE_REQUEST 65536
+/** Largest number of arguments that a --client request can carry. */
+#define MAX_SERVE_ARGS 1024
+
+/** Open a unix-domain stream socket at path, either listening on it or
+ * connected to it.  Return the socket on success, -1 on failure. */
+static int
+open_unix_socket_(const char *path, int listening)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("Socket path %s is too long.\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (listening) {
+		/* Clear away a socket left over from an earlier run, but
+		 * nothing else. */
+		if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(path);
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		    listen(fd, 16) < 0) {
+			perror(path);
+			close(fd);
+			return -1;
+		}
+	} else if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/** Open a TCP socket for addr, which must be "HOST:PORT", either listening
+ * on it or connected to it.  An empty HOST means loopback, and "*" means
+ * every local address: nothing checks who connects, so we only listen
+ * beyond this machine when asked to.  Return the socket on success, -1 on
+ * failure. */
+static int
+open_tcp_socket_(const char *addr, int listening)
+{
+	struct addrinfo hints, *ai, *res = NULL;
+	const char *colon = strrchr(addr, ':');
+	char host[256];
+	int fd = -1, one = 1, r;
+
+	if ((size_t)(colon - addr) >= sizeof(host)) {
+		printf("Host name in %s is too long.\n", addr);
+		return -1;
+	}
+	memcpy(host, addr, colon - addr);
+	host[colon - addr] = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	/* Without AI_PASSIVE, a NULL host is the loopback address. */
+	if (listening && !strcmp(host, "*"))
+		hints.ai_flags = AI_PASSIVE;
+	if (!strcmp(host, "*"))
+		host[0] = '\0';
+	if ((r = getaddrinfo(*host ? host : NULL, colon+1, &hints, &res))) {
+		printf("Couldn't look up %s: %s\n", addr, gai_strerror(r));
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+			    ai->ai_protocol)) < 0)
+			continue;
+		if (listening) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one,
+			    sizeof(one));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+			    listen(fd, 16) == 0)
+				break;
+		} else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0)
+		perror(addr);
+	freeaddrinfo(res);
+	return fd;
+}
+
+/** Open a socket for addr, which is either a path for a unix-domain socket
+ * or HOST:PORT for TCP. */
+static int
+open_socket_(const char *addr, int listening)
+{
+	if (strchr(addr, ':') && !strchr(addr, '/'))
+		return open_tcp_socket_(addr, listening);
+	return open_unix_socket_(addr, listening);
+}
+
+/** Return 1 if a --client request may contain arg: a test name or pattern,
+ * or an option that only changes what gets printed.  Options that write
+ * files or change how tests run stay with whoever started the server. */
+static int
+served_arg_ok_(const char *arg)
+{
+	static const char *const ok[] = {
+		"--verbose", "--quiet", "--terse", "--list-tests", "--help",
+		NULL
+	};
+	int i;
+	if (arg[0] != '-')
+		return 1;
+	for (i = 0; ok[i]; ++i)
+		if (!strcmp(arg, ok[i]))
+			return 1;
+	return 0;
+}
+
+/** Answer one --client request on fd: read the newline-separated
+ * arguments that the client sent, run them through tinytest_main in a
+ * fork of this (already warm) process with its output going to the
+ * client, and finish with a NUL byte followed by the exit status. */
+static void
+serve_one_request_(int fd, struct testgroup_t *groups)
+{
+	static char buf[MAX_SERVE_REQUEST+1];
+	const char *args[MAX_SERVE_ARGS+1];
+	size_t len = 0;
+	ssize_t r;
+	int n_args = 1, status, i;
+	char *cp, *eol, trailer[2];
+	pid_t pid;
+
+	while (len < MAX_SERVE_REQUEST &&
+	       (r = read(fd, buf+len, MAX_SERVE_REQUEST-len)) != 0) {
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		len += (size_t)r;
+	}
+	buf[len] = '\0';
+
+	args[0] = "tinytest";
+	for (cp = buf; *cp && n_args < MAX_SERVE_ARGS; cp = eol) {
+		if ((eol = strchr(cp, '\n')))
+			*eol++ = '\0';
+		else
+			eol = cp + strlen(cp);
+		if (*cp)
+			args[n_args++] = cp;
+	}
+	args[n_args] = NULL;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		status = 1;
+	} else if (!pid) {
+		/* child.  Send the client each line as soon as it's done,
+		 * along with anything the tests write to stderr. */
+		dup2(fd, 1);
+		dup2(fd, 2);
+		close(fd);
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		opt_served = 1;
+		for (i = 1; i < n_args; ++i) {
+			if (!served_arg_ok_(args[i])) {
+				printf("%s isn't allowed from --client.\n",
+				    args[i]);
+				exit(1);
+			}
+		}
+		/* Run what the client asked for, not what the server's own
+		 * command line selected. */
+		tinytest_set_flag_(groups, "..", 0, TT_ENABLED_|TT_SKIP);
+		exit(tinytest_main(n_args, args, groups));
+	} else {
+		/* parent */
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			;
+		status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+	}
+	trailer[0] = '\0';
+	trailer[1] = (char)status;
+	(void) write_all_(fd, trailer, 2);
+}
+
+/** Implement --serve: accept --client requests on the socket at path until
+ * something goes wrong. */
+static int
+serve_(const char *path, struct testgroup_t *groups)
+{
+	int listener, fd;
+
+	if ((listener = open_socket_(path, 1)) < 0)
+		return -1;
+	signal(SIGPIPE, SIG_IGN);
+	if (tinytest_verbosity_ > 0)
+		printf("Serving tests on %s\n", path);
+	/* Whoever started us may be waiting for that line. */
+	fflush(stdout);
+	for (;;) {
+		if ((fd = accept(listener, NULL, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			break;
+		}
+		serve_one_request_(fd, groups);
+		close(fd);
+	}
+	close(listener);
+	return -1;
+}
+
+/** Implement --client: send args to the server at path, copy its output
+ * to stdout as it arrives, and return its exit status. */
+static int
+run_client_(const char *path, int n_args, const char **args)
+{
+	char buf[4096];
+	size_t held = 0;
+	ssize_t r;
+	int fd, i;
+
+	if ((fd = open_socket_(path, 0)) < 0)
+		return -1;
+	for (i = 0; i < n_args; ++i) {
+		if (write_all_(fd, args[i], strlen(args[i])) < 0 ||
+		    write_all_(fd, "\n", 1) < 0) {
+			perror("write request to socket");
+			close(fd);
+			return -1;
+		}
+	}
+	shutdown(fd, SHUT_WR);
+
+	/* Hold back the last two bytes we've seen: they might be the
+	 * trailer. */
+	while ((r = read(fd, buf+held, sizeof(buf)-held)) != 0) {
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		held += (size_t)r;
+		if (held > 2) {
+			fwrite(buf, 1, held-2, stdout);
+			fflush(stdout);
+			buf[0] = buf[held-2];
+			buf[1] = buf[held-1];
+			held = 2;
+		}
+	}
+	close(fd);
+
+	if (held != 2 || buf[0] != '\0') {
+		fwrite(buf, 1, held, stdout);
+		printf("[Lost connection to %s!]\n", path);
+		return -1;
+	}
+	switch ((unsigned char)buf[1]) {
+	case 0: return 0;
+	case 255: return -1;
+	default: return 1;
+	}
+}
+
+/* With --coordinate, this process doesn't run tests itself: it hands them
+ * out, one at a time, to --worker processes that connect to it, so that a
+ * worker with fast tests just asks for more.  The coordinator sends
+ * "RUN name\n" or "QUIT\n".  The worker runs the test as usual and answers
+ * with one line per record, and then the outcome:
+ *
+ *     F <tab> line <tab> file <tab> message
+ *     M <tab> value <tab> name
+ *     V <tab> key <tab> value
+ *     O <tab> OK|FAIL|SKIP
+ *
+ * with tabs, newlines, and backslashes in the fields escaped.  If a worker
+ * goes away in the middle of a test, we give the test to another worker,
+ * up to MAX_TEST_ATTEMPTS times in all. */
+#define MAX_TEST_ATTEMPTS 3
+
+/** Add s to b, escaped for our line protocol. */
+static void
+add_escaped_(struct strbuf_ *b, const char *s)
+{
+	for (; *s; ++s) {
+		if (*s == '\t')
+			strbuf_printf_(b, "\\t");
+		else if (*s == '\n')
+			strbuf_printf_(b, "\\n");
+		else if (*s == '\\')
+			strbuf_printf_(b, "\\\\");
+		else
+			strbuf_printf_(b, "%c", *s);
+	}
+}
+
+/** Undo add_escaped_ on s, in place. */
+static void
+unescape_(char *s)
+{
+	char *out = s;
+	for (; *s; ++s) {
+		if (*s == '\\' && s[1]) {
+			++s;
+			*out++ = *s == 't' ? '\t' : *s == 'n' ? '\n' : *s;
+		} else {
+			*out++ = *s;
+		}
+	}
+	*out = '\0';
+}
+
+/** Find the test called fullname, and set *group and *testcase to it.
+ * Return 0 on success, -1 if there's no such test. */
+static int
+find_test_(struct testgroup_t *groups, const char *fullname,
+	   struct testgroup_t **group, struct testcase_t **testcase)
+{
+	int i, j;
+	size_t n;
+	for (i=0; groups[i].prefix; ++i) {
+		n = strlen(groups[i].prefix);
+		if (strncmp(fullname, groups[i].prefix, n))
+			continue;
+		for (j=0; groups[i].cases[j].name; ++j) {
+			if (!strcmp(fullname+n, groups[i].cases[j].name)) {
+				*group = &groups[i];
+				*testcase = &groups[i].cases[j];
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+/** Implement --worker: run the tests that the coordinator at addr asks for
+ * until it says to stop, and send it the results. */
+static int
+run_worker_(const char *addr, struct testgroup_t *groups)
+{
+	struct testgroup_t *group;
+	struct testcase_t *testcase;
+	struct strbuf_ b;
+	char line[LONGEST_TEST_NAME+16], *nl;
+	enum outcome outcome;
+	enum record_type type;
+	const char *body;
+	size_t off, n;
+	unsigned int l;
+	double d;
+	FILE *in;
+	int fd;
+
+	if ((fd = open_socket_(addr, 0)) < 0)
+		return -1;
+	if (!(in = fdopen(fd, "r"))) {
+		perror("fdopen");
+		close(fd);
+		return -1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	in_tinytest_main = 0; /* Wait for async tests where they are. */
+
+	while (fgets(line, sizeof(line), in) && !strncmp(line, "RUN ", 4)) {
+		if ((nl = strchr(line, '\n')))
+			*nl = '\0';
+		if (find_test_(groups, line+4, &group, &testcase) == 0) {
+			/* The coordinator has already decided to run it. */
+			testcase->flags &= ~TT_OFF_BY_DEFAULT;
+			outcome = (enum outcome)
+			    testcase_run_one(group, testcase);
+		} else {
+			cur_records_len = 0;
+			tinytest_record_failure_(__FILE__, __LINE__,
+			    tinytest_format_("No test called %s on this worker",
+				line+4));
+			outcome = FAIL;
+		}
+
+		b.len = 0;
+		b.s = (char *)malloc(b.alloc = 256);
+		for (off = 0; (n = parse_record_(cur_records+off,
+			    cur_records_len-off, &type, &body)); off += n) {
+			if (type == REC_FAILURE) {
+				memcpy(&l, body, sizeof(l));
+				strbuf_printf_(&b, "F\t%u\t", l);
+				add_escaped_(&b, body+sizeof(l));
+				strbuf_printf_(&b, "\t");
+				add_escaped_(&b, body+sizeof(l)+strlen(
+				    body+sizeof(l))+1);
+			} else if (type == REC_METRIC) {
+				memcpy(&d, body, sizeof(d));
+				strbuf_printf_(&b, "M\t%.17g\t", d);
+				add_escaped_(&b, body+sizeof(d));
+			} else if (type == REC_VALUE) {
+				strbuf_printf_(&b, "V\t");
+				add_escaped_(&b, body);
+				strbuf_printf_(&b, "\t");
+				add_escaped_(&b, body+strlen(body)+1);
+			} else {
+				continue;
+			}
+			strbuf_printf_(&b, "\n");
+		}
+		strbuf_printf_(&b, "O\t%s\n", outcome_names_[outcome]);
+		if (!b.s || write_all_(fd, b.s, b.len) < 0) {
+			free(b.s);
+			break;
+		}
+		free(b.s);
+		fflush(stdout);
+	}
+	fclose(in);
+	return 0;
+}
+
+/** A test that the coordinator is handing out. */
+struct work_item_ {
+	const struct testgroup_t *group;
+	const struct testcase_t *testcase;
+	int attempts; /**< How many workers we've given it to. */
+};
+
+/** A worker that's connected to the coordinator. */
+struct worker_conn_ {
+	int fd;
+	int item; /**< Index of the test it's running, or -1. */
+	char *buf; /**< What it has sent about that test so far. */
+	size_t len, alloc;
+};
+
+/** Print and count the result of item, from the lines in buf. */
+static void
+report_worker_result_(const struct work_item_ *item, char *buf)
+{
+	char fullname[LONGEST_TEST_NAME];
+	char *line, *eol, *f1, *f2;
+	enum outcome outcome = FAIL;
+	int o;
+
+	snprintf(fullname, sizeof(fullname), "%s%s",
+		 item->group->prefix, item->testcase->name);
+	cur_records_len = 0;
+	for (line = buf; *line; line = eol) {
+		if ((eol = strchr(line, '\n')))
+			*eol++ = '\0';
+		else
+			eol = line + strlen(line);
+		if (!(f1 = strchr(line, '\t')))
+			continue;
+		*f1++ = '\0';
+		if ((f2 = strchr(f1, '\t')))
+			*f2++ = '\0';
+		if (line[0] == REC_OUTCOME) {
+			for (o = 0; o < 3 && strcmp(f1, outcome_names_[o]); ++o)
+				;
+			if (o < 3)
+				outcome = (enum outcome)o;
+			continue;
+		}
+		if (!f2)
+			continue;
+		if (line[0] == REC_FAILURE) {
+			char *msg = strchr(f2, '\t');
+			if (!msg)
+				continue;
+			*msg++ = '\0';
+			unescape_(f2);
+			unescape_(msg);
+			printf("\n  FAIL %s:%s: %s", f2, f1, msg);
+			tinytest_record_failure_(f2, atoi(f1),
+			    tinytest_format_("%s", msg));
+		} else if (line[0] == REC_METRIC) {
+			unescape_(f2);
+			tinytest_record_metric_(f2, strtod(f1, NULL));
+		} else if (line[0] == REC_VALUE) {
+			unescape_(f1);
+			unescape_(f2);
+			tinytest_record_value_(f1, f2);
+		}
+	}
+	if (tinytest_verbosity_==0 && outcome != FAIL)
+		printf(".");
+	report_outcome_(fullname, outcome);
+}
+
+/** Fork a worker that runs tests for the coordinator at addr, with its
+ * output thrown away. */
+static void
+spawn_local_worker_(const char *addr, int listener,
+		    struct testgroup_t *groups)
+{
+	pid_t pid;
+	int devnull;
+	fflush(stdout);
+	if (journal)
+		fflush(journal);
+	if ((pid = fork()) < 0) {
+		perror("fork");
+	} else if (!pid) {
+		close(listener);
+		journal = NULL;
+		if ((devnull = open("/dev/null", O_WRONLY)) >= 0) {
+			dup2(devnull, 1);
+			close(devnull);
+		}
+		exit(run_worker_(addr, groups) < 0 ? 1 : 0);
+	}
+}
+
+/** Implement --coordinate: hand out the enabled tests in groups to workers
+ * that connect to addr, and start n_local of them ourself. */
+static int
+coordinate_(const char *addr, int n_local, struct testgroup_t *groups)
+{
+	struct work_item_ *items = NULL;
+	struct worker_conn_ *workers = NULL;
+	struct pollfd *fds = NULL, *nfds;
+	int *todo = NULL; /* A stack of indices into items. */
+	int n_items = 0, n_todo = 0, n_workers = 0, n_running = 0;
+	int listener, i, j, k;
+	char local_addr[300];
+	char fullname[LONGEST_TEST_NAME];
+	ssize_t r;
+
+	for (i=0; groups[i].prefix; ++i)
+		for (j=0; groups[i].cases[j].name; ++j)
+			++n_items;
+	items = (struct work_item_ *)calloc(n_items+1, sizeof(*items));
+	todo = (int *)calloc(n_items+1, sizeof(int));
+	if (!items || !todo) {
+		perror("calloc");
+		return -1;
+	}
+	/* Skipped and resumed tests, we can report right here. */
+	n_items = 0;
+	for (i=0; groups[i].prefix; ++i) {
+		for (j=0; groups[i].cases[j].name; ++j) {
+			const struct testcase_t *tc = &groups[i].cases[j];
+			if (!(tc->flags & TT_ENABLED_))
+				continue;
+			snprintf(fullname, sizeof(fullname), "%s%s",
+			    groups[i].prefix, tc->name);
+			if ((tc->flags & (TT_SKIP|TT_OFF_BY_DEFAULT)) ||
+			    find_resumed_(fullname)) {
+				testcase_run_one(&groups[i], tc);
+				continue;
+			}
+			items[n_items].group = &groups[i];
+			items[n_items].testcase = tc;
+			++n_items;
+		}
+	}
+	for (i = n_items-1; i >= 0; --i)
+		todo[n_todo++] = i;
+
+	if ((listener = open_socket_(addr, 1)) < 0)
+		return -1;
+	signal(SIGPIPE, SIG_IGN);
+	snprintf(local_addr, sizeof(local_addr), "%s", addr);
+	if (strchr(addr, ':') && !strchr(addr, '/')) {
+		/* Local workers need the real port, if we asked for port 0. */
+		struct sockaddr_storage ss;
+		socklen_t sslen = sizeof(ss);
+		int port = 0;
+		if (getsockname(listener, (struct sockaddr *)&ss, &sslen) == 0)
+			port = ntohs(ss.ss_family == AF_INET6 ?
+			    ((struct sockaddr_in6 *)&ss)->sin6_port :
+			    ((struct sockaddr_in *)&ss)->sin_port);
+		snprintf(local_addr, sizeof(local_addr), "%.*s:%d",
+		    (int)(strrchr(addr, ':') - addr), addr, port);
+		if (local_addr[0] == ':')
+			snprintf(local_addr, sizeof(local_addr),
+			    "localhost:%d", port);
+	}
+	if (tinytest_verbosity_ > 0)
+		printf("Handing out %d tests on %s\n", n_items, local_addr);
+	for (i = 0; i < n_local && n_todo; ++i)
+		spawn_local_worker_(local_addr, listener, groups);
+
+	while (n_todo || n_running) {
+		struct worker_conn_ *w;
+		/* Give every idle worker something to do. */
+		for (i = 0; i < n_workers && n_todo; ++i) {
+			w = &workers[i];
+			if (w->item >= 0)
+				continue;
+			w->item = todo[--n_todo];
+			++items[w->item].attempts;
+			++n_running;
+			w->len = 0;
+			snprintf(fullname, sizeof(fullname), "RUN %s%s\n",
+			    items[w->item].group->prefix,
+			    items[w->item].testcase->name);
+			(void) write_all_(w->fd, fullname, strlen(fullname));
+		}
+
+		nfds = (struct pollfd *)realloc(fds,
+		    (n_workers+1) * sizeof(struct pollfd));
+		if (!nfds) {
+			perror("realloc");
+			break;
+		}
+		fds = nfds;
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for (i = 0; i < n_workers; ++i) {
+			fds[i+1].fd = workers[i].fd;
+			fds[i+1].events = POLLIN;
+		}
+		if (poll(fds, n_workers+1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+
+		/* Look at the workers before accepting new ones, so that
+		 * fds and workers still line up. */
+		for (i = 0, k = 0; k < n_workers; ++k) {
+			w = &workers[k];
+			r = 0;
+			if (fds[k+1].revents) {
+				if (w->len + 4096 + 1 > w->alloc) {
+					size_t alloc = (w->len + 4096 + 1) * 2;
+					char *buf = (char *)realloc(w->buf,
+					    alloc);
+					if (buf) {
+						w->buf = buf;
+						w->alloc = alloc;
+					}
+				}
+				if (w->len + 4096 + 1 > w->alloc)
+					r = -1;
+				else if ((r = read(w->fd, w->buf+w->len,
+					    4096)) < 0 && errno == EINTR)
+					r = 1;
+				else if (r > 0)
+					w->len += r;
+			} else {
+				r = 1;
+			}
+			if (r > 0 && w->item >= 0 && w->len) {
+				char *end;
+				w->buf[w->len] = '\0';
+				/* The outcome line ends the result. */
+				end = w->len > 1 && w->buf[w->len-1] == '\n' ?
+				    w->buf + w->len - 1 : NULL;
+				while (end && end > w->buf && end[-1] != '\n')
+					--end;
+				if (end && end[0] == REC_OUTCOME &&
+				    end[1] == '\t') {
+					report_worker_result_(&items[w->item],
+					    w->buf);
+					w->item = -1;
+					w->len = 0;
+					--n_running;
+				}
+			}
+			if (r <= 0) {
+				/* The worker went away. */
+				close(w->fd);
+				if (w->item >= 0) {
+					struct work_item_ *it =
+					    &items[w->item];
+					--n_running;
+					printf("\n[Lost a worker running "
+					    "%s%s]", it->group->prefix,
+					    it->testcase->name);
+					if (it->attempts < MAX_TEST_ATTEMPTS) {
+						puts("  Trying again.");
+						todo[n_todo++] = w->item;
+					} else {
+						puts("");
+						cur_records_len = 0;
+						snprintf(fullname,
+						    sizeof(fullname), "%s%s",
+						    it->group->prefix,
+						    it->testcase->name);
+						report_outcome_(fullname, FAIL);
+					}
+				}
+				free(w->buf);
+				if (n_local && n_todo)
+					spawn_local_worker_(local_addr,
+					    listener, groups);
+				continue;
+			}
+			workers[i++] = *w;
+		}
+		n_workers = i;
+
+		if (fds[0].revents) {
+			struct worker_conn_ *nw;
+			int fd = accept(listener, NULL, NULL);
+			if (fd < 0) {
+				if (errno != EINTR)
+					perror("accept");
+				continue;
+			}
+			nw = (struct worker_conn_ *)realloc(workers,
+			    (n_workers+1) * sizeof(struct worker_conn_));
+			if (!nw) {
+				close(fd);
+				continue;
+			}
+			workers = nw;
+			memset(&workers[n_workers], 0, sizeof(*workers));
+			workers[n_workers].fd = fd;
+			workers[n_workers].item = -1;
+			++n_workers;
+		}
+	}
+
+	for (i = 0; i < n_workers; ++i) {
+		(void) write_all_(workers[i].fd, "QUIT\n", 5);
+		close(workers[i].fd);
+		free(workers[i].buf);
+	}
+	close(listener);
+	if (!strchr(addr, ':') || strchr(addr, '/'))
+		unlink(addr);
+	while (n_local && wait(NULL) > 0)
+		;
+	free(workers);
+	free(fds);
+	free(items);
+	free(todo);
+	return 0;
+}
+
+#endif
+
+int
+tinytest_main(int c, const char **v, struct testgroup_t *groups)
+{
+	int i, j, n=0;
+	const char *journal_path = NULL, *resume_path = NULL;
+#ifdef HAVE_CPU_PINNING_
+	const char *pin_list = NULL, *isolate_list = NULL;
+	int want_pin = 0;
+#endif
+#if !defined(NO_FORKING) && !defined(_WIN32)
+	const char *serve_path = NULL;
+	const char *coordinate_addr = NULL, *worker_addr = NULL;
+	int n_local_workers = 0;
+#endif
+
+#ifdef _WIN32
+	const char *sp = strrchr(v[0], '.');
+	const char *extension = "";
+	if (!sp || stricmp(sp, ".exe"))
+		extension = ".exe"; /* Add an exe so CreateProcess will work */
+	snprintf(commandname, sizeof(commandname), "%s%s", v[0], extension);
+	commandname[MAX_PATH]='\0';
+#endif
+	for (i=1; i<c; ++i) {
+		if (v[i][0] == '-') {
+			if (!strcmp(v[i], "--RUNNING-FORKED")) {
+				opt_forked = 1;
+			} else if (!strcmp(v[i], "--no-fork")) {
+				opt_nofork = 1;
+			} else if (!strcmp(v[i], "--quiet")) {
+				tinytest_verbosity_ = -1;
+				verbosity_flag = "--quiet";
+			} else if (!strcmp(v[i], "--verbose")) {
+				tinytest_verbosity_ = 2;
+				verbosity_flag = "--verbose";
+			} else if (!strcmp(v[i], "--terse")) {
+				tinytest_verbosity_ = 0;
+				verbosity_flag = "--terse";
+			} else if (!strcmp(v[i], "--help")) {
+				usage(groups, 0);
+			} else if (!strcmp(v[i], "--list-tests")) {
+				usage(groups, 1);
+			} else if (!strncmp(v[i], "--stress-repeat=", 16)) {
+				opt_repeat = atoi(v[i]+16);
+				if (opt_repeat < 1) {
+					printf("Bad repeat count in %s\n",
+					    v[i]);
+					return -1;
+				}
+			} else if (!strcmp(v[i], "--update-golden")) {
+				opt_update_golden = 1;
+			} else if (!strncmp(v[i], "--fixture-dir=", 14)) {
+				opt_fixture_dir = v[i]+14;
+			} else if (!strncmp(v[i], "--journal=", 10)) {
+				journal_path = v[i]+10;
+			} else if (!strncmp(v[i], "--resume=", 9)) {
+				resume_path = v[i]+9;
+			} else if (!strcmp(v[i], "--pin") ||
+				   !strncmp(v[i], "--pin=", 6) ||
+				   !strncmp(v[i], "--isolate=", 10)) {
+#ifdef HAVE_CPU_PINNING_
+				want_pin = 1;
+				if (v[i][5] == '=')
+					pin_list = v[i]+6;
+				else if (v[i][2] == 'i')
+					isolate_list = v[i]+10;
+#else
+				printf("%s isn't supported on this platform.\n",
+				       v[i]);
+				return -1;
+#endif
+			} else if (!strcmp(v[i], "--malloc-sweep") ||
+				   !strncmp(v[i], "--malloc-sweep=", 15)) {
+#ifdef HAVE_MALLOC_SWEEP_
+				opt_malloc_sweep = v[i][14] ?
+				    strtoul(v[i]+15, NULL, 10) : ~0UL;
+#else
+				printf("--malloc-sweep needs tinytest built "
+				       "with TINYTEST_INTERPOSE_MALLOC.\n");
+				return -1;
+#endif
+			} else if (!strncmp(v[i], "--profile=", 10)) {
+#ifdef HAVE_PROFILER_
+				opt_profile_dir = v[i]+10;
+#else
+				printf("--profile isn't supported on this "
+				       "platform.\n");
+				return -1;
+#endif
+#if !defined(NO_FORKING) && !defined(_WIN32)
+			} else if (!strncmp(v[i], "--serve=", 8) &&
+				   !opt_served) {
+				serve_path = v[i]+8;
+			} else if (!strncmp(v[i], "--client=", 9) &&
+				   !opt_served) {
+				return run_client_(v[i]+9, c-i-1, v+i+1);
+			} else if (!strncmp(v[i], "--coordinate=", 13)) {
+				coordinate_addr = v[i]+13;
+			} else if (!strncmp(v[i], "--worker=", 9)) {
+				worker_addr = v[i]+9;
+			} else if (!strncmp(v[i], "--local-workers=", 16)) {
+				n_local_workers = atoi(v[i]+16);
+#endif
+			} else {
+				printf("Unknown option %s.  Try --help\n",v[i]);
+				return -1;
+			}
+		} else {
+			int r = process_test_option(groups, v[i]);
+			if (r<0)
+				return -1;
+			n += r;
+		}
+	}
+#if !defined(NO_FORKING) && !defined(_WIN32)
+	if (serve_path)
+		return serve_(serve_path, groups);
+#endif
+	if (!n)
+		tinytest_set_flag_(groups, "..", 1, TT_ENABLED_);
+
+#ifdef HAVE_CPU_PINNING_
+	if (want_pin && setup_pinning_(pin_list, isolate_list) < 0)
+		return -1;
+#endif
+	if (resume_path && load_journal_(resume_path) < 0)
+		return -1;
+	if (journal_path) {
+		if (!(journal = fopen(journal_path, "a"))) {
+			perror(journal_path);
+			return -1;
+		}
+		journal_has_resumed = resume_path &&
+		    !strcmp(journal_path, resume_path);
+	}
+
+#ifdef _IONBF
+	setvbuf(stdout, NULL, _IONBF, 0);
+#endif
+
+#if !defined(NO_FORKING) && !defined(_WIN32)
+	if (worker_addr)
+		return run_worker_(worker_addr, groups);
+	if (coordinate_addr && coordinate_(coordinate_addr, n_local_workers,
+		groups) < 0)
+		return -1;
+#endif
+
+	++in_tinytest_main;
+#if !defined(NO_FORKING) && !defined(_WIN32)
+	if (!coordinate_addr)
+#endif
+	for (i=0; groups[i].prefix; ++i) {
+		for (j=0; groups[i].cases[j].name; ++j) {
+			if (groups[i].cases[j].flags & TT_ENABLED_)
+				testcase_run_one(&groups[i],
+						 &groups[i].cases[j]);
+#ifndef _WIN32
+			if (async_pending)
+				run_async_once_(0);
+#endif
+		}
+	}
+#ifndef _WIN32
+	while (async_pending)
+		run_async_once_(1);
+#endif
+
+	--in_tinytest_main;
+
+	if (journal) {
+		sync_journal_();
+		fclose(journal);
+		journal = NULL;
+	}
+
+	if (tinytest_verbosity_==0)
+		puts("");
+
+	if (n_bad)
+		printf("%d/%d TESTS FAILED. (%d skipped)\n", n_bad,
+		       n_bad+n_ok,n_skipped);
+	else if (tinytest_verbosity_ >= 1)
+		printf("%d tests ok.  (%d skipped)\n", n_ok, n_skipped);
+
+	return (n_bad == 0) ? 0 : 1;
+}
+
+int
+tinytest_get_verbosity_(void)
+{
+	return tinytest_verbosity_;
+}
+
+void
+tinytest_set_test_failed_(void)
+{
+	LOCK_TEST_STATE_();
+	if (tinytest_verbosity_ <= 0 && cur_test_name) {
+		if (tinytest_verbosity_==0) puts("");
+		printf("%s%s: ", cur_test_prefix, cur_test_name);
+		cur_test_name = NULL;
+	}
+	cur_test_outcome = FAIL;
+	UNLOCK_TEST_STATE_();
+}
+
+void
+tinytest_set_test_skipped_(void)
+{
+	LOCK_TEST_STATE_();
+	if (cur_test_outcome==OK)
+		cur_test_outcome = SKIP;
+	UNLOCK_TEST_STATE_();
+}
+
+#ifndef _WIN32
+
+/** Shared state for the threads in one tinytest_run_threads_() call. */
+struct thread_run_ {
+	testthread_fn fn;
+	void *arg;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int n_ready; /**< How many threads are waiting to start. */
+	int go; /**< 1 once the threads may start; -1 if they must not. */
+};
+
+/** One thread in a tinytest_run_threads_() call. */
+struct thread_info_ {
+	struct thread_run_ *run;
+	int idx;
+	unsigned long ops;
+	pthread_t thread;
+};
+
+static void *
+thread_main_(void *arg)
+{
+	struct thread_info_ *info = (struct thread_info_ *) arg;
+	struct thread_run_ *run = info->run;
+	int go;
+
+	pthread_mutex_lock(&run->lock);
+	++run->n_ready;
+	pthread_cond_broadcast(&run->cond);
+	while (!run->go)
+		pthread_cond_wait(&run->cond, &run->lock);
+	go = run->go;
+	pthread_mutex_unlock(&run->lock);
+
+	if (go > 0)
+		info->ops = run->fn(run->arg, info->idx);
+	return NULL;
+}
+
+unsigned long
+tinytest_run_threads_(int n_threads, testthread_fn fn, void *arg, int pin)
+{
+	struct thread_run_ run;
+	struct thread_info_ *info;
+	unsigned long total = 0;
+	double start, elapsed;
+	char name[64];
+	int i, n_started;
+#ifdef HAVE_CPU_PINNING_
+	cpu_set_t cpus, one;
+	int last_cpu = -1;
+	if (opt_pin)
+		cpus = pin_cpus;
+	else if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+		pin = 0;
+#endif
+
+	if (n_threads < 1 || !(info = (struct thread_info_ *)
+		calloc(n_threads, sizeof(*info)))) {
+		tt_fail_msg("Couldn't set up threads");
+		return 0;
+	}
+#ifdef HAVE_MALLOC_SWEEP_
+	++sweep_paused;
+#endif
+	memset(&run, 0, sizeof(run));
+	run.fn = fn;
+	run.arg = arg;
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.cond, NULL);
+
+	for (n_started = 0; n_started < n_threads; ++n_started) {
+		info[n_started].run = &run;
+		info[n_started].idx = n_started;
+		if (pthread_create(&info[n_started].thread, NULL, thread_main_,
+			&info[n_started]))
+			break;
+#ifdef HAVE_CPU_PINNING_
+		if (pin) {
+			CPU_ZERO(&one);
+			CPU_SET(next_cpu_(&cpus, &last_cpu), &one);
+			pthread_setaffinity_np(info[n_started].thread,
+			    sizeof(one), &one);
+		} else if (opt_pin) {
+			/* Don't leave them all on the CPU that --pin gave
+			 * the test. */
+			pthread_setaffinity_np(info[n_started].thread,
+			    sizeof(cpus), &cpus);
+		}
+#else
+		(void)pin;
+#endif
+	}
+
+	/* Wait for every thread to reach the barrier, then let them all go
+	 * at once. */
+	pthread_mutex_lock(&run.lock);
+	while (run.n_ready < n_started)
+		pthread_cond_wait(&run.cond, &run.lock);
+	run.go = (n_started == n_threads) ? 1 : -1;
+	start = now_seconds_();
+	pthread_cond_broadcast(&run.cond);
+	pthread_mutex_unlock(&run.lock);
+
+	for (i = 0; i < n_started; ++i)
+		pthread_join(info[i].thread, NULL);
+	elapsed = now_seconds_() - start;
+
+	if (n_started < n_threads) {
+		tt_fail_printf(("Couldn't start thread %d of %d",
+			n_started+1, n_threads));
+	} else {
+		for (i = 0; i < n_threads; ++i) {
+			snprintf(name, sizeof(name), "thread%d.ops", i);
+			tinytest_record_metric_(name, (double)info[i].ops);
+			total += info[i].ops;
+		}
+		tinytest_record_metric_("threads", n_threads);
+		tinytest_record_metric_("ops", (double)total);
+		if (elapsed > 0)
+			tinytest_record_metric_("ops_per_sec", total / elapsed);
+	}
+
+	pthread_cond_destroy(&run.cond);
+	pthread_mutex_destroy(&run.lock);
+	free(info);
+#ifdef HAVE_MALLOC_SWEEP_
+	--sweep_paused;
+#endif
+	return total;
+}
+
+#else
+
+unsigned long
+tinytest_run_threads_(int n_threads, testthread_fn fn, void *arg, int pin)
+{
+	(void)n_threads; (void)fn; (void)arg; (void)pin;
+	tt_fail_msg("tt_run_threads() isn't supported on Windows yet");
+	return 0;
+}
+
+#endif
+
+char *
+tinytest_format_hex_(const void *val_, unsigned long len)
+{
+	const unsigned char *val = (unsigned char *) val_;
+	char *result, *cp;
+	size_t i;
+
+	if (!val)
+		return strdup("null");
+	if (!(result = (char *) malloc(len*2+1)))
+		return strdup("<allocation failure>");
+	cp = result;
+	for (i=0;i<len;++i) {
+		*cp++ = "0123456789ABCDEF"[val[i] >> 4];
+		*cp++ = "0123456789ABCDEF"[val[i] & 0x0f];
+	}
+	*cp = 0;
+	return result;
+}
+
+char *
+tinytest_format_(const char *fmt, ...)
+{
+	va_list ap;
+	char *result;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0 || !(result = (char *) malloc((size_t)len+1)))
+		return strdup("<allocation failure>");
+	va_start(ap, fmt);
+	vsnprintf(result, (size_t)len+1, fmt, ap);
+	va_end(ap);
+	return result;
+}
+
+void
+tinytest_declare_(const char *prefix, const char *file, int line, char *msg)
+{
+	char *s = tinytest_format_("\n  %s %s:%d: %s", prefix, file, line,
+	    msg ? msg : "");
+#ifndef _WIN32
+	flockfile(stdout);
+#endif
+	fputs(s, stdout);
+#ifndef _WIN32
+	funlockfile(stdout);
+#endif
+	free(s);
+	free(msg);
+}
+
+void
+tinytest_record_failure_(const char *file, int line, char *msg)
+{
+	unsigned int l = (unsigned int)line;
+	add_record_(REC_FAILURE, &l, sizeof(l), file, msg ? msg : "");
+	free(msg);
+}
+
+void
+tinytest_record_metric_(const char *name, double value)
+{
+	add_record_(REC_METRIC, &value, sizeof(value), name, NULL);
+}
+
+void
+tinytest_record_value_(const char *key, const char *value)
+{
+	add_record_(REC_VALUE, NULL, 0, key, value);
+}
+
+/* Counters for tt_counter_add().  Each counter name gets an id, which is
+ * its slot in counter_names, an open-addressed hash table that only grows.
+ * Each thread adds to its own counter_block_, so that threads never write
+ * to the same cache line; we add the blocks up when somebody asks. */
+#define MAX_COUNTERS 256
+#define COUNTER_CACHE_LINE 64
+struct counter_block_ {
+	long counts[MAX_COUNTERS];
+	struct counter_block_ *next;
+	int in_use; /**< True iff a live thread is adding to this block. */
+};
+#define COUNTER_BLOCK_SIZE						\
+	((sizeof(struct counter_block_) + COUNTER_CACHE_LINE - 1)	\
+	    / COUNTER_CACHE_LINE * COUNTER_CACHE_LINE)
+static char *counter_names[MAX_COUNTERS];
+static struct counter_block_ *counter_blocks = NULL;
+#ifndef _WIN32
+static __thread struct counter_block_ *counter_block_mine = NULL;
+/** Only used so that we hear when threads exit. */
+static pthread_key_t counter_key;
+static pthread_once_t counter_key_once = PTHREAD_ONCE_INIT;
+
+/** Called when a thread exits: let another thread have its block, counts
+ * and all. */
+static void
+counter_block_release_(void *arg)
+{
+	LOCK_TEST_STATE_();
+	((struct counter_block_ *)arg)->in_use = 0;
+	UNLOCK_TEST_STATE_();
+}
+
+static void
+counter_key_init_(void)
+{
+	pthread_key_create(&counter_key, counter_block_release_);
+}
+#else
+static struct counter_block_ *counter_block_mine = NULL;
+#endif
+
+/** Give the current thread a counter block, or return NULL if we can't. */
+static struct counter_block_ *
+counter_block_new_(void)
+{
+	struct counter_block_ *b;
+	void *mem = NULL;
+#ifndef _WIN32
+	pthread_once(&counter_key_once, counter_key_init_);
+#endif
+	LOCK_TEST_STATE_();
+	for (b = counter_blocks; b && b->in_use; b = b->next)
+		;
+	if (!b) {
+#ifndef _WIN32
+		if (posix_memalign(&mem, COUNTER_CACHE_LINE,
+			COUNTER_BLOCK_SIZE))
+			mem = NULL;
+#else
+		mem = malloc(sizeof(struct counter_block_));
+#endif
+		if ((b = (struct counter_block_ *) mem)) {
+			memset(b, 0, sizeof(*b));
+			b->next = counter_blocks;
+			counter_blocks = b;
+		}
+	}
+	if (b)
+		b->in_use = 1;
+	UNLOCK_TEST_STATE_();
+#ifndef _WIN32
+	if (b)
+		pthread_setspecific(counter_key, b);
+#endif
+	return counter_block_mine = b;
+}
+
+/** Return the id of the counter called name, or -1 if there isn't one.  If
+ * add, register the name if it's new.  Hold the test state lock. */
+static int
+counter_find_(const char *name, int add)
+{
+	unsigned h = 2166136261u;
+	const char *cp;
+	int i;
+
+	for (cp = name; *cp; ++cp)
+		h = (h ^ (unsigned char)*cp) * 16777619u;
+	for (i = 0; i < MAX_COUNTERS; ++i) {
+		int slot = (int)((h + i) % MAX_COUNTERS);
+		if (!counter_names[slot]) {
+			if (!add)
+				return -1;
+			counter_names[slot] = strdup(name);
+		}
+		if (counter_names[slot] && !strcmp(counter_names[slot], name))
+			return slot;
+	}
+	return -1;
+}
+
+int
+tinytest_counter_id_(const char *name)
+{
+	int id;
+	LOCK_TEST_STATE_();
+	id = counter_find_(name, 1);
+	UNLOCK_TEST_STATE_();
+	if (id < 0)
+		tt_fail_printf(("Too many counters to add \"%s\"", name));
+	return id;
+}
+
+void
+tinytest_counter_add_(int id, long delta)
+{
+	struct counter_block_ *b = counter_block_mine;
+	if (!b && !(b = counter_block_new_()))
+		return;
+	if (id >= 0)
+		b->counts[id] += delta;
+}
+
+/** Return the total of the counter with id, across all threads. */
+static long
+counter_sum_(int id)
+{
+	struct counter_block_ *b;
+	long total = 0;
+	for (b = counter_blocks; b; b = b->next)
+		total += b->counts[id];
+	return total;
+}
+
+long
+tinytest_counter_get_(const char *name)
+{
+	long total = 0;
+	int id;
+	LOCK_TEST_STATE_();
+	if ((id = counter_find_(name, 0)) >= 0)
+		total = counter_sum_(id);
+	UNLOCK_TEST_STATE_();
+	return total;
+}
+
+/** Set every counter back to zero, before a test. */
+static void
+counters_reset_(void)
+{
+	struct counter_block_ *b;
+	LOCK_TEST_STATE_();
+	for (b = counter_blocks; b; b = b->next)
+		memset(b->counts, 0, sizeof(b->counts));
+	UNLOCK_TEST_STATE_();
+}
+
+/** Record every counter that isn't zero as a "counter.NAME" metric, after
+ * a test. */
+static void
+counters_record_(void)
+{
+	char name[128];
+	long total;
+	int i;
+	if (!counter_blocks)
+		return;
+	for (i = 0; i < MAX_COUNTERS; ++i) {
+		LOCK_TEST_STATE_();
+		total = counter_names[i] ? counter_sum_(i) : 0;
+		UNLOCK_TEST_STATE_();
+		if (!total)
+			continue;
+		snprintf(name, sizeof(name), "counter.%s", counter_names[i]);
+		tinytest_record_metric_(name, (double)total);
+	}
+}
+
+#ifndef _WIN32
+
+/** Exchange the current counts with the MAX_COUNTERS counts in saved, when
+ * an async test's callbacks start or stop running. */
+static void
+counters_swap_(long *saved)
+{
+	struct counter_block_ *b, *mine;
+	long total;
+	int i;
+	if (!(mine = counter_block_mine) && !(mine = counter_block_new_()))
+		return;
+	LOCK_TEST_STATE_();
+	for (i = 0; i < MAX_COUNTERS; ++i) {
+		total = counter_sum_(i);
+		for (b = counter_blocks; b; b = b->next)
+			b->counts[i] = 0;
+		mine->counts[i] = saved[i];
+		saved[i] = total;
+	}
+	UNLOCK_TEST_STATE_();
+}
+
+struct tinytest_async_t *
+tinytest_async_begin_(const char *file, int line, long timeout_msec)
+{
+	struct tinytest_async_t *a;
+	if (!running_testcase || cur_async)
+		return cur_async;
+	if (!(a = (struct tinytest_async_t *) calloc(1, sizeof(*a))))
+		return NULL;
+	if (!(a->counts = (long *) calloc(MAX_COUNTERS, sizeof(long)))) {
+		free(a);
+		return NULL;
+	}
+	a->group = running_group;
+	a->testcase = running_testcase;
+	a->deadline = now_seconds_() + timeout_msec / 1000.0;
+	a->file = file;
+	a->line = line;
+	return cur_async = a;
+}
+
+/** Add an event to a's list.  Return 0 on success, -1 on failure. */
+static int
+add_async_event_(struct tinytest_async_t *a, int fd, short events,
+		 long msec, testasync_cb cb, void *arg)
+{
+	struct async_event_ *e;
+	if (!a || !(e = (struct async_event_ *) calloc(1, sizeof(*e))))
+		return -1;
+	e->fd = fd;
+	e->events = events;
+	e->deadline = now_seconds_() + msec / 1000.0;
+	e->pollidx = -1;
+	e->cb = cb;
+	e->arg = arg;
+	e->next = a->events;
+	a->events = e;
+	return 0;
+}
+
+int
+tinytest_async_watch_(struct tinytest_async_t *a, int fd, int what,
+		      testasync_cb cb, void *arg)
+{
+	short events = 0;
+	if (what & TT_ASYNC_READ)
+		events |= POLLIN;
+	if (what & TT_ASYNC_WRITE)
+		events |= POLLOUT;
+	return add_async_event_(a, fd, events, 0, cb, arg);
+}
+
+int
+tinytest_async_timer_(struct tinytest_async_t *a, long msec,
+		      testasync_cb cb, void *arg)
+{
+	return add_async_event_(a, -1, 0, msec, cb, arg);
+}
+
+void
+tinytest_async_done_(struct tinytest_async_t *a)
+{
+	if (a)
+		a->done = 1;
+}
+
+#else
+
+struct tinytest_async_t *
+tinytest_async_begin_(const char *file, int line, long timeout_msec)
+{
+	(void)file; (void)line; (void)timeout_msec;
+	tt_fail_msg("Async tests aren't supported on Windows yet");
+	return NULL;
+}
+
+int
+tinytest_async_watch_(struct tinytest_async_t *a, int fd, int what,
+		      testasync_cb cb, void *arg)
+{
+	(void)a; (void)fd; (void)what; (void)cb; (void)arg;
+	return -1;
+}
+
+int
+tinytest_async_timer_(struct tinytest_async_t *a, long msec,
+		      testasync_cb cb, void *arg)
+{
+	(void)a; (void)msec; (void)cb; (void)arg;
+	return -1;
+}
+
+void
+tinytest_async_done_(struct tinytest_async_t *a)
+{
+	(void)a;
+}
+
+#endif
+
+#ifndef _WIN32
+
+/* Golden files.  We map the golden file (and, for tt_files_eq_golden, the
+ * actual output) and compare in chunks, so that a big file is never
+ * copied.  On a mismatch, we find the common prefix and suffix, and diff
+ * the lines between them with Myers's linear-space algorithm, giving up
+ * on lines too far past the first difference.  The result is a unified
+ * diff, cut short after GOLDEN_MAX_DIFF_LINES lines. */
+
+/** How many bytes to compare at a time. */
+#define GOLDEN_CHUNK (1<<20)
+/** Most lines past the first difference that we try to diff. */
+#define GOLDEN_MAX_LINES 4096
+/** Most lines of diff output we'll produce. */
+#define GOLDEN_MAX_DIFF_LINES 64
+/** Most bytes of any one line that we'll show. */
+#define GOLDEN_MAX_LINE_LEN 160
+/** Lines of context around each change. */
+#define GOLDEN_CONTEXT 3
+
+/** A file's contents, mapped into memory. */
+struct mapped_file_ {
+	const char *mem;
+	size_t len;
+};
+
+/** Map the file at path.  Return 0 on success, and -1 (setting errno) on
+ * failure. */
+static int
+map_file_(const char *path, struct mapped_file_ *m)
+{
+	struct stat st;
+	int fd;
+	void *mem;
+	m->mem = NULL;
+	m->len = 0;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size) {
+		mem = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+			   fd, 0);
+		if (mem == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		madvise(mem, (size_t)st.st_size, MADV_SEQUENTIAL);
+		m->mem = (const char *)mem;
+		m->len = (size_t)st.st_size;
+	}
+	close(fd);
+	return 0;
+}
+
+static void
+unmap_file_(struct mapped_file_ *m)
+{
+	if (m->mem)
+		munmap((void *)m->mem, m->len);
+	m->mem = NULL;
+}
+
+/** One line of a file we're diffing. */
+struct diff_line_ {
+	const char *p;
+	size_t len; /**< Including the newline, if any. */
+	unsigned hash;
+};
+
+/** The two sequences of lines that we're diffing, and what we know about
+ * them so far. */
+struct diff_ {
+	struct diff_line_ *x, *y;
+	char *xchanged, *ychanged; /**< Which lines are not in the other. */
+	int *fd, *bd; /**< Furthest reach on each diagonal, both ways. */
+};
+
+static int
+diff_lines_eq_(const struct diff_ *d, int i, int j)
+{
+	return d->x[i].hash == d->y[j].hash && d->x[i].len == d->y[j].len &&
+	    !memcmp(d->x[i].p, d->y[j].p, d->x[i].len);
+}
+
+/** Find the middle snake of the shortest edit script from x[xoff..xlim) to
+ * y[yoff..ylim), and store a point on it in *xmid, *ymid.  Both ranges must
+ * be nonempty, with different first lines and different last lines. */
+static void
+diff_middle_(struct diff_ *d, int xoff, int xlim, int yoff, int ylim,
+	     int *xmid, int *ymid)
+{
+	int *fd = d->fd, *bd = d->bd;
+	const int dmin = xoff - ylim, dmax = xlim - yoff;
+	const int fmid = xoff - yoff, bmid = xlim - ylim;
+	int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+	const int odd = (fmid - bmid) & 1;
+	int k, x, y;
+
+	fd[fmid] = xoff;
+	bd[bmid] = xlim;
+	for (;;) {
+		if (fmin > dmin)
+			fd[--fmin - 1] = -1;
+		else
+			++fmin;
+		if (fmax < dmax)
+			fd[++fmax + 1] = -1;
+		else
+			--fmax;
+		for (k = fmax; k >= fmin; k -= 2) {
+			x = fd[k-1] >= fd[k+1] ? fd[k-1] + 1 : fd[k+1];
+			y = x - k;
+			while (x < xlim && y < ylim && diff_lines_eq_(d, x, y))
+				++x, ++y;
+			fd[k] = x;
+			if (odd && bmin <= k && k <= bmax && bd[k] <= x) {
+				*xmid = x;
+				*ymid = y;
+				return;
+			}
+		}
+		if (bmin > dmin)
+			bd[--bmin - 1] = INT_MAX;
+		else
+			++bmin;
+		if (bmax < dmax)
+			bd[++bmax + 1] = INT_MAX;
+		else
+			--bmax;
+		for (k = bmax; k >= bmin; k -= 2) {
+			x = bd[k-1] < bd[k+1] ? bd[k-1] : bd[k+1] - 1;
+			y = x - k;
+			while (x > xoff && y > yoff &&
+			       diff_lines_eq_(d, x-1, y-1))
+				--x, --y;
+			bd[k] = x;
+			if (!odd && fmin <= k && k <= fmax && x <= fd[k]) {
+				*xmid = x;
+				*ymid = y;
+				return;
 			}
-			return n;
 		}
 	}
-	printf("No such test alias as @%s!",test);
-	return -1;
 }
 
+/** Mark the lines of x[xoff..xlim) and y[yoff..ylim) that aren't in a
+ * longest common subsequence of the two. */
+static void
+diff_compare_(struct diff_ *d, int xoff, int xlim, int yoff, int ylim)
+{
+	int xmid, ymid;
+	while (xoff < xlim && yoff < ylim && diff_lines_eq_(d, xoff, yoff))
+		++xoff, ++yoff;
+	while (xlim > xoff && ylim > yoff && diff_lines_eq_(d, xlim-1, ylim-1))
+		--xlim, --ylim;
+	if (xoff == xlim) {
+		while (yoff < ylim)
+			d->ychanged[yoff++] = 1;
+	} else if (yoff == ylim) {
+		while (xoff < xlim)
+			d->xchanged[xoff++] = 1;
+	} else {
+		diff_middle_(d, xoff, xlim, yoff, ylim, &xmid, &ymid);
+		diff_compare_(d, xoff, xmid, yoff, ymid);
+		diff_compare_(d, xmid, xlim, ymid, ylim);
+	}
+}
+
+/** Split the n bytes at p into at most max lines, and return how many
+ * there were.  Set *rest to the number of bytes we didn't get to. */
 static int
-process_test_option(struct testgroup_t *groups, const char *test)
+split_lines_(const char *p, size_t n, struct diff_line_ *lines, int max,
+	     size_t *rest)
 {
-	int flag = TT_ENABLED_;
-	int n = 0;
-	if (test[0] == '@') {
-		return process_test_alias(groups, test + 1);
-	} else if (test[0] == ':') {
-		++test;
-		flag = TT_SKIP;
-	} else if (test[0] == '+') {
-		++test;
-		++n;
-		if (!tinytest_set_flag_(groups, test, 0, TT_OFF_BY_DEFAULT)) {
-			printf("No such test as %s!\n", test);
+	int i = 0;
+	while (n && i < max) {
+		const char *nl = (const char *)memchr(p, '\n', n);
+		size_t len = nl ? (size_t)(nl - p) + 1 : n;
+		unsigned hash = 2166136261u;
+		size_t k;
+		for (k = 0; k < len; ++k)
+			hash = (hash ^ (unsigned char)p[k]) * 16777619u;
+		lines[i].p = p;
+		lines[i].len = len;
+		lines[i].hash = hash;
+		++i;
+		p += len;
+		n -= len;
+	}
+	*rest = n;
+	return i;
+}
+
+static void
+diff_print_line_(struct strbuf_ *b, char mark, const struct diff_line_ *l)
+{
+	size_t len = l->len;
+	int newline = len && l->p[len-1] == '\n';
+	if (newline)
+		--len;
+	if (len > GOLDEN_MAX_LINE_LEN)
+		strbuf_printf_(b, "%c%.*s...\n", mark, GOLDEN_MAX_LINE_LEN,
+		    l->p);
+	else
+		strbuf_printf_(b, "%c%.*s\n", mark, (int)len, l->p);
+	if (!newline)
+		strbuf_printf_(b, "\\ No newline at end of file\n");
+}
+
+/** Print the first line number and line count of one side of a hunk, the
+ * way diff -u does. */
+static void
+diff_print_range_(struct strbuf_ *b, long first, int n)
+{
+	if (n == 1)
+		strbuf_printf_(b, "%ld", first);
+	else
+		strbuf_printf_(b, "%ld,%d", n ? first : first - 1, n);
+}
+
+/** Return the offset of the first byte where a and b differ, or the length
+ * of the shorter one if it is a prefix of the other. */
+static size_t
+common_prefix_(const char *a, size_t alen, const char *b, size_t blen)
+{
+	size_t n = alen < blen ? alen : blen, off = 0, chunk;
+	while (off < n) {
+		chunk = n - off < GOLDEN_CHUNK ? n - off : GOLDEN_CHUNK;
+		if (memcmp(a+off, b+off, chunk))
+			break;
+		off += chunk;
+	}
+	while (off < n && a[off] == b[off])
+		++off;
+	return off;
+}
+
+/** Return a newly allocated unified diff between the golden contents g and
+ * the actual contents a, which are known to differ. */
+static char *
+golden_diff_(const char *path, const char *g, size_t glen,
+	     const char *a, size_t alen)
+{
+	struct strbuf_ b = { NULL, 0, 0 };
+	struct diff_ d;
+	size_t start, suffix = 0, grest, arest, k;
+	size_t max_suffix;
+	long lineno = 1;
+	int ctx, nx, ny, i, j, n_out = 0;
+
+	b.s = (char *)malloc(b.alloc = 256);
+	if (!b.s)
+		return NULL;
+	b.s[0] = '\0';
+	memset(&d, 0, sizeof(d));
+
+	/* Start GOLDEN_CONTEXT lines before the line with the first
+	 * difference. */
+	start = common_prefix_(g, glen, a, alen);
+	/* The common suffix mustn't overlap the common prefix, or the line
+	 * diff can slide the change into the trailing context. */
+	max_suffix = (glen < alen ? glen : alen) - start;
+	for (ctx = 0; start > 0; --start)
+		if (g[start-1] == '\n' && ctx++ == GOLDEN_CONTEXT)
+			break;
+	for (k = 0; k < start; ++k)
+		if (g[k] == '\n')
+			++lineno;
+
+	/* Stop GOLDEN_CONTEXT lines after the start of the common suffix. */
+	while (suffix < max_suffix && g[glen-suffix-1] == a[alen-suffix-1])
+		++suffix;
+	for (ctx = 0, k = suffix; suffix > 0; --suffix)
+		if (suffix < k && g[glen-suffix-1] == '\n' &&
+		    ctx++ == GOLDEN_CONTEXT)
+			break;
+
+	d.x = (struct diff_line_ *)calloc(GOLDEN_MAX_LINES,
+	    sizeof(struct diff_line_));
+	d.y = (struct diff_line_ *)calloc(GOLDEN_MAX_LINES,
+	    sizeof(struct diff_line_));
+	d.xchanged = (char *)calloc(GOLDEN_MAX_LINES, 1);
+	d.ychanged = (char *)calloc(GOLDEN_MAX_LINES, 1);
+	d.fd = (int *)calloc(2*GOLDEN_MAX_LINES + 3, sizeof(int));
+	d.bd = (int *)calloc(2*GOLDEN_MAX_LINES + 3, sizeof(int));
+	if (!d.x || !d.y || !d.xchanged || !d.ychanged || !d.fd || !d.bd)
+		goto done;
+	nx = split_lines_(g+start, glen-suffix-start, d.x, GOLDEN_MAX_LINES,
+	    &grest);
+	ny = split_lines_(a+start, alen-suffix-start, d.y, GOLDEN_MAX_LINES,
+	    &arest);
+	d.fd += ny + 1;
+	d.bd += ny + 1;
+	diff_compare_(&d, 0, nx, 0, ny);
+	d.fd -= ny + 1;
+	d.bd -= ny + 1;
+
+	strbuf_printf_(&b, "%s differs from the expected output:\n", path);
+	strbuf_printf_(&b, "--- %s\n+++ (actual)\n", path);
+	i = j = 0;
+	while (i < nx || j < ny) {
+		int hi, hj, ei, ej, run;
+		if (i < nx && j < ny && !d.xchanged[i] && !d.ychanged[j]) {
+			++i, ++j;
+			continue;
+		}
+		/* A hunk starts up to GOLDEN_CONTEXT lines before here, and
+		 * runs until there are more than twice that many unchanged
+		 * lines in a row. */
+		for (run = 0; run < GOLDEN_CONTEXT && run < i && run < j; ++run)
+			;
+		hi = i - run;
+		hj = j - run;
+		for (;;) {
+			while (i < nx && d.xchanged[i])
+				++i;
+			while (j < ny && d.ychanged[j])
+				++j;
+			for (run = 0; i+run < nx && j+run < ny &&
+				 !d.xchanged[i+run] && !d.ychanged[j+run] &&
+				 run <= 2*GOLDEN_CONTEXT; ++run)
+				;
+			if (run > 2*GOLDEN_CONTEXT ||
+			    (i+run == nx && j+run == ny)) {
+				if (run > GOLDEN_CONTEXT)
+					run = GOLDEN_CONTEXT;
+				break;
+			}
+			i += run;
+			j += run;
+		}
+		ei = i + run;
+		ej = j + run;
+		strbuf_printf_(&b, "@@ -");
+		diff_print_range_(&b, lineno + hi, ei - hi);
+		strbuf_printf_(&b, " +");
+		diff_print_range_(&b, lineno + hj, ej - hj);
+		strbuf_printf_(&b, " @@\n");
+		while ((hi < ei || hj < ej) && n_out < GOLDEN_MAX_DIFF_LINES) {
+			if (hi < ei && hj < ej && !d.xchanged[hi] &&
+			    !d.ychanged[hj]) {
+				diff_print_line_(&b, ' ', &d.x[hi]);
+				++hi, ++hj, ++n_out;
+				continue;
+			}
+			while (hi < ei && d.xchanged[hi] &&
+			       n_out++ < GOLDEN_MAX_DIFF_LINES)
+				diff_print_line_(&b, '-', &d.x[hi++]);
+			while (hj < ej && d.ychanged[hj] &&
+			       n_out++ < GOLDEN_MAX_DIFF_LINES)
+				diff_print_line_(&b, '+', &d.y[hj++]);
+		}
+		if (n_out >= GOLDEN_MAX_DIFF_LINES) {
+			strbuf_printf_(&b, "... (diff truncated)\n");
+			break;
+		}
+		i = ei;
+		j = ej;
+	}
+	if ((grest || arest) && n_out < GOLDEN_MAX_DIFF_LINES)
+		strbuf_printf_(&b, "... (gave up after %d lines)\n",
+		    GOLDEN_MAX_LINES);
+	if (b.s)
+		b.s[b.len ? b.len-1 : 0] = '\0'; /* No trailing newline. */
+
+ done:
+	free(d.x);
+	free(d.y);
+	free(d.xchanged);
+	free(d.ychanged);
+	free(d.fd);
+	free(d.bd);
+	return b.s;
+}
+
+/** Like tinytest_format_(), but return NULL when we run out of memory,
+ * since the message that it returns instead would make a poor filename. */
+static char *
+format_path_(const char *fmt, ...)
+{
+	va_list ap;
+	char *result;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0 || !(result = (char *) malloc((size_t)len+1)))
+		return NULL;
+	va_start(ap, fmt);
+	vsnprintf(result, (size_t)len+1, fmt, ap);
+	va_end(ap);
+	return result;
+}
+
+/** Replace the file at path with the len bytes at buf, so that anybody
+ * reading it sees either the old contents or the new ones.  Return 0 on
+ * success, -1 on failure. */
+static int
+replace_file_(const char *path, const void *buf, size_t len)
+{
+	char *tmp = format_path_("%s.tmp.%ld", path, (long)getpid());
+	const char *p = (const char *)buf;
+	ssize_t n;
+	int fd;
+	if (!tmp)
+		return -1;
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+		goto err;
+	while (len) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			goto err;
+		}
+		p += n;
+		len -= n;
+	}
+	if (fsync(fd) < 0 || close(fd) < 0 || rename(tmp, path) < 0)
+		goto err;
+	free(tmp);
+	return 0;
+ err:
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+int
+tinytest_file_eq_golden_(const char *path, const void *buf, unsigned long len,
+			 char **diff_out)
+{
+	struct mapped_file_ golden;
+	const char *actual = (const char *)buf;
+	int r = 1, missing = 0;
+	*diff_out = NULL;
+
+	if (map_file_(path, &golden) < 0) {
+		if (!(errno == ENOENT && opt_update_golden)) {
+			*diff_out = tinytest_format_(
+			    "Couldn't read golden file %s: %s",
+			    path, strerror(errno));
 			return -1;
 		}
-	} else {
-		++n;
+		/* An empty buffer matches the empty mapping; create the
+		 * file anyway. */
+		missing = 1;
 	}
-	if (!tinytest_set_flag_(groups, test, 1, flag)) {
-		printf("No such test as %s!\n", test);
+	if (missing || golden.len != len ||
+	    common_prefix_(golden.mem, len, actual, len) != len) {
+		if (opt_update_golden) {
+			if (replace_file_(path, buf, len) < 0) {
+				*diff_out = tinytest_format_(
+				    "Couldn't update golden file %s: %s",
+				    path, strerror(errno));
+				r = -1;
+			} else {
+				tinytest_record_value_("golden_updated", path);
+			}
+		} else {
+			*diff_out = golden_diff_(path, golden.mem, golden.len,
+			    actual, len);
+			r = 0;
+		}
+	}
+	unmap_file_(&golden);
+	return r;
+}
+
+int
+tinytest_files_eq_golden_(const char *path, const char *actual_path,
+			  char **diff_out)
+{
+	struct mapped_file_ actual;
+	int r;
+	if (map_file_(actual_path, &actual) < 0) {
+		*diff_out = tinytest_format_("Couldn't read %s: %s",
+		    actual_path, strerror(errno));
 		return -1;
 	}
-	return n;
+	r = tinytest_file_eq_golden_(path, actual.mem, actual.len, diff_out);
+	unmap_file_(&actual);
+	return r;
 }
 
-void
-tinytest_set_aliases(const struct testlist_alias_t *aliases)
+#else
+
+int
+tinytest_file_eq_golden_(const char *path, const void *buf, unsigned long len,
+			 char **diff_out)
 {
-	cfg_aliases = aliases;
+	(void)path; (void)buf; (void)len;
+	*diff_out = tinytest_format_("%s",
+	    "Golden files aren't supported on Windows yet");
+	return -1;
 }
 
 int
-tinytest_main(int c, const char **v, struct testgroup_t *groups)
+tinytest_files_eq_golden_(const char *path, const char *actual_path,
+			  char **diff_out)
 {
-	int i, j, n=0;
+	(void)actual_path;
+	return tinytest_file_eq_golden_(path, NULL, 0, diff_out);
+}
 
-#ifdef _WIN32
-	const char *sp = strrchr(v[0], '.');
-	const char *extension = "";
-	if (!sp || stricmp(sp, ".exe"))
-		extension = ".exe"; /* Add an exe so CreateProcess will work */
-	snprintf(commandname, sizeof(commandname), "%s%s", v[0], extension);
-	commandname[MAX_PATH]='\0';
 #endif
-	for (i=1; i<c; ++i) {
-		if (v[i][0] == '-') {
-			if (!strcmp(v[i], "--RUNNING-FORKED")) {
-				opt_forked = 1;
-			} else if (!strcmp(v[i], "--no-fork")) {
-				opt_nofork = 1;
-			} else if (!strcmp(v[i], "--quiet")) {
-				opt_verbosity = -1;
-				verbosity_flag = "--quiet";
-			} else if (!strcmp(v[i], "--verbose")) {
-				opt_verbosity = 2;
-				verbosity_flag = "--verbose";
-			} else if (!strcmp(v[i], "--terse")) {
-				opt_verbosity = 0;
-				verbosity_flag = "--terse";
-			} else if (!strcmp(v[i], "--help")) {
-				usage(groups, 0);
-			} else if (!strcmp(v[i], "--list-tests")) {
-				usage(groups, 1);
-			} else {
-				printf("Unknown option %s.  Try --help\n",v[i]);
-				return -1;
+
+#ifndef _WIN32
+
+/* Fixture images.  tinytest_fixture_map() names each image after the
+ * fixture and a hash of its key and of the size, times, and inode of each
+ * of its inputs, so that changing an input means a new image.  Whoever
+ * gets to an image first builds it, holding a lock so that other processes
+ * and threads wait for it instead of building it too, and then removes the
+ * images it replaces. */
+
+/** Held while building a fixture image: lockf() only keeps other processes
+ * out, not other threads in this one. */
+static pthread_mutex_t fixture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Add the len bytes at p to the FNV-1a hash *h. */
+static void
+fixture_hash_(unsigned long long *h, const void *p, size_t len)
+{
+	const unsigned char *cp = (const unsigned char *)p;
+	while (len--)
+		*h = (*h ^ *cp++) * 1099511628211ULL;
+}
+
+/** Return the directory to keep fixture images in. */
+static const char *
+fixture_dir_(void)
+{
+	const char *dir;
+	if (opt_fixture_dir)
+		return opt_fixture_dir;
+	if ((dir = getenv("TMPDIR")) && *dir)
+		return dir;
+	return "/tmp";
+}
+
+/** Remove the images of the fixture called name that are older than the
+ * one called keep, and their lock files.  We only remove an image when we
+ * can lock it without waiting, so that we never pull one out from under
+ * somebody who's building it or waiting to. */
+static void
+fixture_remove_old_(const char *name, const char *keep)
+{
+	const char *dirname = fixture_dir_();
+	char *prefix = format_path_("tt-fixture-%s-", name);
+	size_t n, k;
+	struct dirent *ent;
+	struct stat st;
+	time_t newest;
+	DIR *dir;
+
+	if (!prefix || stat(keep, &st) < 0 || !(dir = opendir(dirname))) {
+		free(prefix);
+		return;
+	}
+	newest = st.st_mtime;
+	n = strlen(prefix);
+	while ((ent = readdir(dir))) {
+		const char *cp = ent->d_name;
+		char *path, *lockpath;
+		int fd;
+		if (strncmp(cp, prefix, n))
+			continue;
+		for (cp += n, k = 0; isxdigit((unsigned char)cp[k]); ++k)
+			;
+		if (k != 16 || strcmp(cp+k, ".lock"))
+			continue;
+		if (!(lockpath = format_path_("%s/%s", dirname, ent->d_name)))
+			continue;
+		path = format_path_("%.*s", (int)(strlen(lockpath)-5),
+		    lockpath);
+		if (path && strcmp(path, keep) && stat(path, &st) == 0 &&
+		    st.st_mtime < newest &&
+		    (fd = open(lockpath, O_RDWR)) >= 0) {
+			if (lockf(fd, F_TLOCK, 0) == 0) {
+				(void) unlink(path);
+				(void) unlink(lockpath);
 			}
-		} else {
-			int r = process_test_option(groups, v[i]);
-			if (r<0)
-				return -1;
-			n += r;
+			close(fd);
 		}
+		free(path);
+		free(lockpath);
 	}
-	if (!n)
-		tinytest_set_flag_(groups, "..", 1, TT_ENABLED_);
+	closedir(dir);
+	free(prefix);
+}
+
+const void *
+tinytest_fixture_map(const char *name, const char *key, const char **inputs,
+		     tinytest_fixture_build_fn build, void *arg,
+		     unsigned long *len_out)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	char *path = NULL, *lockpath = NULL, *tmp = NULL;
+	struct stat st;
+	struct mapped_file_ m;
+	const void *result = NULL;
+	long when[2];
+	int i, lockfd = -1, locked = 0, fd;
+
+	*len_out = 0;
+	/* The name goes into a filename. */
+	if (strchr(name, '/') || strstr(name, "..")) {
+		printf("Fixture name %s can't contain \"/\" or \"..\".\n",
+		    name);
+		return NULL;
+	}
+	fixture_hash_(&h, key, strlen(key)+1);
+	for (i = 0; inputs && inputs[i]; ++i) {
+		if (stat(inputs[i], &st) < 0) {
+			printf("Can't read %s for fixture %s: %s\n", inputs[i],
+			    name, strerror(errno));
+			return NULL;
+		}
+		when[0] = (long)st.st_mtime;
+		when[1] = (long)st.st_ctime;
+		fixture_hash_(&h, inputs[i], strlen(inputs[i])+1);
+		fixture_hash_(&h, &st.st_size, sizeof(st.st_size));
+		fixture_hash_(&h, &st.st_ino, sizeof(st.st_ino));
+		fixture_hash_(&h, when, sizeof(when));
+	}
+	if (!(path = format_path_("%s/tt-fixture-%s-%016llx", fixture_dir_(),
+		    name, h)) ||
+	    !(lockpath = format_path_("%s.lock", path)) ||
+	    !(tmp = format_path_("%s.tmp.%ld", path, (long)getpid()))) {
+		printf("Out of memory mapping fixture %s\n", name);
+		goto done;
+	}
+
+	if (access(path, R_OK) < 0) {
+		pthread_mutex_lock(&fixture_lock);
+		locked = 1;
+		if ((lockfd = open(lockpath, O_RDWR|O_CREAT, 0644)) < 0 ||
+		    lockf(lockfd, F_LOCK, 0) < 0) {
+			printf("Can't lock %s: %s\n", lockpath,
+			    strerror(errno));
+			goto done;
+		}
+		/* Somebody else may have built it while we waited. */
+		if (access(path, R_OK) < 0) {
+			if (build(tmp, arg) < 0) {
+				printf("Couldn't build fixture %s\n", name);
+				goto done;
+			}
+			if ((fd = open(tmp, O_RDONLY)) >= 0) {
+				(void) fsync(fd);
+				close(fd);
+			}
+			if (fd < 0 || rename(tmp, path) < 0) {
+				printf("Couldn't save fixture %s in %s: %s\n",
+				    name, path, strerror(errno));
+				goto done;
+			}
+			fixture_remove_old_(name, path);
+		}
+	}
+	if (map_file_(path, &m) < 0) {
+		printf("Couldn't map fixture %s from %s: %s\n", name, path,
+		    strerror(errno));
+		goto done;
+	}
+	/* Tests don't usually read fixtures from start to end. */
+	if (m.mem)
+		madvise((void *)m.mem, m.len, MADV_NORMAL);
+	result = m.mem ? m.mem : "";
+	*len_out = (unsigned long)m.len;
+ done:
+	if (tmp)
+		unlink(tmp);
+	if (lockfd >= 0)
+		close(lockfd);
+	if (locked)
+		pthread_mutex_unlock(&fixture_lock);
+	free(path);
+	free(lockpath);
+	free(tmp);
+	return result;
+}
+
+void
+tinytest_fixture_unmap(const void *data, unsigned long len)
+{
+	if (len)
+		munmap((void *)data, (size_t)len);
+}
+
+#else
+
+const void *
+tinytest_fixture_map(const char *name, const char *key, const char **inputs,
+		     tinytest_fixture_build_fn build, void *arg,
+		     unsigned long *len_out)
+{
+	(void)key; (void)inputs; (void)build; (void)arg;
+	*len_out = 0;
+	printf("Can't map fixture %s: fixtures aren't supported on Windows "
+	    "yet.\n", name);
+	return NULL;
+}
+
+void
+tinytest_fixture_unmap(const void *data, unsigned long len)
+{
+	(void)data; (void)len;
+}
 
-#ifdef _IONBF
-	setvbuf(stdout, NULL, _IONBF, 0);
 #endif
 
-	++in_tinytest_main;
-	for (i=0; groups[i].prefix; ++i)
-		for (j=0; groups[i].cases[j].name; ++j)
-			if (groups[i].cases[j].flags & TT_ENABLED_)
-				testcase_run_one(&groups[i],
-						 &groups[i].cases[j]);
+#ifndef _WIN32
 
-	--in_tinytest_main;
+/* tt_alloc() hands out memory from an arena where every allocation ends
+ * right where an inaccessible guard page begins, so writing past its end
+ * crashes the test at once.  tt_free() makes an allocation's pages
+ * inaccessible too, so using it afterwards also crashes.  Pages are never
+ * reused within a test; instead, we throw the whole arena away with a
+ * single mmap() before each test. */
 
-	if (opt_verbosity==0)
-		puts("");
+/** How much address space to reserve for the arena. */
+#define ARENA_SIZE ((size_t)1 << (sizeof(void *) > 4 ? 34 : 28))
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#define ARENA_MAP_FLAGS (MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE)
 
-	if (n_bad)
-		printf("%d/%d TESTS FAILED. (%d skipped)\n", n_bad,
-		       n_bad+n_ok,n_skipped);
-	else if (opt_verbosity >= 1)
-		printf("%d tests ok.  (%d skipped)\n", n_ok, n_skipped);
+static char *arena_base = NULL;
+static size_t arena_used = 0; /**< Bytes handed out, in whole pages. */
+static size_t arena_page = 0;
+/** For each page in the arena: 1 + the size of the allocation that
+ * starts in it, or 0. */
+static size_t *arena_sizes = NULL;
+static struct sigaction arena_old_segv; /**< The SIGSEGV handler we hid. */
 
-	return (n_bad == 0) ? 0 : 1;
+/** Hand a SIGSEGV on to the handler that arena_init_() replaced. */
+static void
+arena_chain_segv_(int sig, siginfo_t *info, void *ctx)
+{
+	if (arena_old_segv.sa_flags & SA_SIGINFO) {
+		arena_old_segv.sa_sigaction(sig, info, ctx);
+	} else if (arena_old_segv.sa_handler != SIG_DFL &&
+		   arena_old_segv.sa_handler != SIG_IGN) {
+		arena_old_segv.sa_handler(sig);
+	} else {
+		/* Put back the default action, and let the access happen
+		 * again, so that we die of it. */
+		signal(SIGSEGV, SIG_DFL);
+	}
 }
 
-int
-tinytest_get_verbosity_(void)
+/** If a test crashes by touching a guard page or freed memory, say so
+ * before it dies.  Every SIGSEGV goes on to the handler we replaced. */
+static void
+arena_segv_handler_(int sig, siginfo_t *info, void *ctx)
 {
-	return opt_verbosity;
+	static const char msg[] = "\n  FAIL: touched a guard page or freed "
+	    "memory in the tt_alloc() arena\n";
+	char *addr = (char *)info->si_addr;
+	if (arena_base && addr >= arena_base && addr < arena_base + ARENA_SIZE)
+		(void) write(1, msg, sizeof(msg)-1);
+	arena_chain_segv_(sig, info, ctx);
 }
 
-void
-tinytest_set_test_failed_(void)
+/** Reserve the arena.  Return 0 on success, -1 on failure. */
+static int
+arena_init_(void)
 {
-	if (opt_verbosity <= 0 && cur_test_name) {
-		if (opt_verbosity==0) puts("");
-		printf("%s%s: ", cur_test_prefix, cur_test_name);
-		cur_test_name = NULL;
+	struct sigaction sa;
+	void *p;
+
+	arena_page = (size_t)sysconf(_SC_PAGESIZE);
+	p = mmap(NULL, ARENA_SIZE, PROT_NONE, ARENA_MAP_FLAGS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	arena_base = (char *)p;
+	p = mmap(NULL, ARENA_SIZE / arena_page * sizeof(size_t),
+	    PROT_READ|PROT_WRITE, ARENA_MAP_FLAGS, -1, 0);
+	if (p == MAP_FAILED) {
+		munmap(arena_base, ARENA_SIZE);
+		arena_base = NULL;
+		return -1;
 	}
-	cur_test_outcome = FAIL;
+	arena_sizes = (size_t *)p;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = arena_segv_handler_;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &arena_old_segv);
+	return 0;
 }
 
-void
-tinytest_set_test_skipped_(void)
+/** Throw away everything in the arena. */
+static void
+arena_reset_(void)
 {
-	if (cur_test_outcome==OK)
-		cur_test_outcome = SKIP;
+	size_t n_sizes;
+	if (!arena_used)
+		return;
+	n_sizes = arena_used / arena_page * sizeof(size_t);
+	n_sizes = (n_sizes + arena_page - 1) / arena_page * arena_page;
+	if (mmap(arena_base, arena_used, PROT_NONE, ARENA_MAP_FLAGS|MAP_FIXED,
+		-1, 0) == MAP_FAILED) {
+		/* The kernel won't map anything while a process has too
+		 * many mappings, even to replace them.  Unmap first. */
+		munmap(arena_base, arena_used);
+		if (mmap(arena_base, arena_used, PROT_NONE,
+			ARENA_MAP_FLAGS|MAP_FIXED, -1, 0) == MAP_FAILED)
+			return;
+	}
+	memset(arena_sizes, 0, n_sizes);
+	madvise(arena_sizes, n_sizes, MADV_DONTNEED);
+	arena_used = 0;
 }
 
-char *
-tinytest_format_hex_(const void *val_, unsigned long len)
+/** Return the number of pages an allocation of n bytes takes, not
+ * counting its guard page. */
+static size_t
+arena_pages_(size_t n)
 {
-	const unsigned char *val = (unsigned char *) val_;
-	char *result, *cp;
-	size_t i;
+	return n ? (n + arena_page - 1) / arena_page : 1;
+}
 
-	if (!val)
-		return strdup("null");
-	if (!(result = (char *) malloc(len*2+1)))
-		return strdup("<allocation failure>");
-	cp = result;
-	for (i=0;i<len;++i) {
-		*cp++ = "0123456789ABCDEF"[val[i] >> 4];
-		*cp++ = "0123456789ABCDEF"[val[i] & 0x0f];
+void *
+tinytest_alloc_(unsigned long n)
+{
+	size_t pages;
+	char *p;
+
+	LOCK_TEST_STATE_();
+	if (!arena_base && arena_init_() < 0) {
+		UNLOCK_TEST_STATE_();
+		return NULL;
 	}
-	*cp = 0;
-	return result;
+	pages = arena_pages_(n);
+	if (n > ARENA_SIZE || arena_used + (pages+1)*arena_page > ARENA_SIZE) {
+		UNLOCK_TEST_STATE_();
+		return NULL;
+	}
+	p = arena_base + arena_used;
+	arena_used += (pages+1)*arena_page;
+	UNLOCK_TEST_STATE_();
+
+	if (mprotect(p, pages*arena_page, PROT_READ|PROT_WRITE) < 0)
+		return NULL;
+	p += pages*arena_page - n;
+	arena_sizes[(p - arena_base) / arena_page] = n + 1;
+	return p;
+}
+
+void
+tinytest_free_(void *ptr)
+{
+	char *p = (char *)ptr;
+	size_t idx, n;
+
+	if (!p)
+		return;
+	if (!arena_base || p < arena_base || p >= arena_base + arena_used ||
+	    !(n = arena_sizes[idx = (size_t)(p - arena_base) / arena_page])) {
+		tt_fail_msg("tt_free() of memory that didn't come from "
+		    "tt_alloc(), or that was already freed");
+		return;
+	}
+	--n;
+	arena_sizes[idx] = 0;
+	p = p + n - arena_pages_(n)*arena_page;
+	mprotect(p, arena_pages_(n)*arena_page, PROT_NONE);
+	madvise(p, arena_pages_(n)*arena_page, MADV_DONTNEED);
+}
+
+#else
+
+void *
+tinytest_alloc_(unsigned long n)
+{
+	return calloc(1, n ? n : 1);
+}
+
+void
+tinytest_free_(void *ptr)
+{
+	free(ptr);
 }
+
+#endif
@@ -26,6 +26,10 @@
 #ifndef TINYTEST_H_INCLUDED_
 #define TINYTEST_H_INCLUDED_
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /** Flag for a test that needs to run in a subprocess. */
 #define TT_FORK  (1<<0)
 /** Runtime flag for a test we've decided to skip. */
@@ -34,10 +38,39 @@
 #define TT_ENABLED_  (1<<2)
 /** Flag for a test that's off by default. */
 #define TT_OFF_BY_DEFAULT  (1<<3)
-/** If you add your own flags, make them start at this point. */
-#define TT_FIRST_USER_FLAG (1<<4)
+/** Flag for a test, like a benchmark, that should get one of the CPUs
+ * reserved with --isolate. */
+#define TT_ISOLATED  (1<<4)
+/** Flag for a test whose sleeps and timeouts should finish at once, with
+ * the clocks jumping ahead instead.  Needs tinytest built with
+ * TINYTEST_INTERPOSE_TIME. */
+#define TT_VIRTUAL_TIME  (1<<5)
+/** If you add your own flags, make them start at this point.  Everything
+ * below it is kept for tinytest's own flags, so that adding one doesn't
+ * move this.  (It was (1<<4) in tinytest 1.0.1.) */
+#define TT_FIRST_USER_FLAG (1<<16)
 
 typedef void (*testcase_fn)(void *);
+/** A function to run on several threads at once with tt_run_threads():
+ * takes the argument to tt_run_threads() and the thread's index, and
+ * returns how many operations it did. */
+typedef unsigned long (*testthread_fn)(void *, int);
+
+/** State for a test that's waiting for something to happen; see
+ * tt_async_begin(). */
+struct tinytest_async_t;
+/** A callback for an async test: called with the test's state, the file
+ * descriptor that's ready (or -1 for a timer), and the callback's
+ * argument. */
+typedef void (*testasync_cb)(struct tinytest_async_t *, int, void *);
+/** Events that an async test can wait for on a file descriptor. */
+#define TT_ASYNC_READ  (1<<0)
+#define TT_ASYNC_WRITE (1<<1)
+
+/** A function to build a fixture image for tinytest_fixture_map(): takes
+ * the path to write the image to, and the argument to
+ * tinytest_fixture_map(), and returns 0 on success or -1 on failure. */
+typedef int (*tinytest_fixture_build_fn)(const char *, void *);
 
 struct testcase_t;
 
@@ -72,17 +105,81 @@ struct testlist_alias_t {
 };
 #define END_OF_ALIASES { NULL, NULL }
 
+/** Names of the symbols that tinytest_runner looks up in a test module
+ * that it loads: a "struct testgroup_t *" pointing to the module's
+ * END_OF_GROUPS-terminated groups, and an optional
+ * "struct testlist_alias_t *" pointing to its aliases. */
+#define TT_MODULE_GROUPS_SYMBOL "tinytest_module_groups"
+#define TT_MODULE_ALIASES_SYMBOL "tinytest_module_aliases"
+
 /** Implementation: called from a test to indicate failure, before logging. */
 void tinytest_set_test_failed_(void);
 /** Implementation: called from a test to indicate that we're skipping. */
 void tinytest_set_test_skipped_(void);
 /** Implementation: return 0 for quiet, 1 for normal, 2 for loud. */
 int tinytest_get_verbosity_(void);
+/** Implementation: the same, for checks that can't afford a call. */
+extern int tinytest_verbosity_;
 /** Implementation: Set a flag on tests matching a name; returns number
  * of tests that matched. */
 int tinytest_set_flag_(struct testgroup_t *, const char *, int set, unsigned long);
 /** Implementation: Put a chunk of memory into hex. */
 char *tinytest_format_hex_(const void *, unsigned long);
+/** Implementation: Format a string printf-style into newly allocated
+ * memory. */
+char *tinytest_format_(const char *fmt, ...);
+/** Implementation: Print msg as a check's result at file:line, all at once.
+ * Takes ownership of msg, which must come from tinytest_format_(). */
+void tinytest_declare_(const char *prefix, const char *file, int line,
+    char *msg);
+/** Implementation: Record a failure at file:line for the current test.
+ * Takes ownership of msg, which must come from tinytest_format_(). */
+void tinytest_record_failure_(const char *file, int line, char *msg);
+/** Implementation: Record a named number for the current test. */
+void tinytest_record_metric_(const char *name, double value);
+/** Implementation: Record a key/value pair for the current test. */
+void tinytest_record_value_(const char *key, const char *value);
+/** Implementation: Return the id of the counter called name, registering
+ * it if it's new, or -1 if there are too many counters. */
+int tinytest_counter_id_(const char *name);
+/** Implementation: Add delta to the counter with id, for this thread. */
+void tinytest_counter_add_(int id, long delta);
+/** Implementation: Return the counter called name, summed over threads, or
+ * 0 if nothing has counted it yet. */
+long tinytest_counter_get_(const char *name);
+/** Implementation: Run fn on n_threads threads that all start at once, and
+ * return the total number of operations they did.  If pin, bind each
+ * thread to its own CPU. */
+unsigned long tinytest_run_threads_(int n_threads, testthread_fn fn,
+    void *arg, int pin);
+/** Implementation: Return 1 if the len bytes at buf match the golden file
+ * at path, 0 if they don't, and -1 on error.  Unless we return 1, set
+ * *diff_out to a newly allocated description of the problem. */
+int tinytest_file_eq_golden_(const char *path, const void *buf,
+    unsigned long len, char **diff_out);
+/** Implementation: As tinytest_file_eq_golden_, for the contents of the
+ * file at actual_path. */
+int tinytest_files_eq_golden_(const char *path, const char *actual_path,
+    char **diff_out);
+/** Implementation: Move virtual time forward by msec milliseconds. */
+void tinytest_advance_time_(long msec);
+/** Implementation: Allocate n bytes that end at a guard page. */
+void *tinytest_alloc_(unsigned long n);
+/** Implementation: Release memory from tinytest_alloc_, and make it
+ * inaccessible. */
+void tinytest_free_(void *ptr);
+/** Implementation: Make the current test asynchronous, failing it at
+ * file:line if it hasn't finished within timeout_msec. */
+struct tinytest_async_t *tinytest_async_begin_(const char *file, int line,
+    long timeout_msec);
+/** Implementation: Call cb once when fd is ready for 'what'. */
+int tinytest_async_watch_(struct tinytest_async_t *, int fd, int what,
+    testasync_cb cb, void *arg);
+/** Implementation: Call cb once after msec milliseconds. */
+int tinytest_async_timer_(struct tinytest_async_t *, long msec,
+    testasync_cb cb, void *arg);
+/** Implementation: Mark an async test as finished. */
+void tinytest_async_done_(struct tinytest_async_t *);
 
 /** Set all tests in 'groups' matching the name 'named' to be skipped. */
 #define tinytest_skip(groups, named) \
@@ -93,8 +190,26 @@ int testcase_run_one(const struct testgroup_t *,const struct testcase_t *);
 
 void tinytest_set_aliases(const struct testlist_alias_t *aliases);
 
+/** Map the fixture image called name read-only, and return a pointer to
+ * it, setting *len_out to its length.  Inputs is a NULL-terminated list of
+ * the files that the image is made from, and key is a string for whatever
+ * else it depends on.  If there's no image yet for this key and these
+ * versions of the inputs, call build(path, arg) to write one first.  Every
+ * process that maps the same image shares its memory, and the image may be
+ * at a different address in each one, so it must hold offsets instead of
+ * pointers.  Return NULL on failure. */
+const void *tinytest_fixture_map(const char *name, const char *key,
+    const char **inputs, tinytest_fixture_build_fn build, void *arg,
+    unsigned long *len_out);
+/** Unmap an image from tinytest_fixture_map(). */
+void tinytest_fixture_unmap(const void *data, unsigned long len);
+
 /** Run a set of testcases from an END_OF_GROUPS-terminated array of groups,
     as selected from the command line. */
 int tinytest_main(int argc, const char **argv, struct testgroup_t *groups);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
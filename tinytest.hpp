@@ -0,0 +1,309 @@
+/* tinytest.hpp -- Copyright 2009-2012 Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* A C++ front end for tinytest.
+ *
+ * This header gives you type-aware versions of the tt_*_op() checks, which
+ * compare their operands as their own types instead of casting them to long
+ * or to a pointer, and which format them only when the check fails (or when
+ * running with --verbose).  It also lets you register tests as lambdas.
+ * Everything here is built on tinytest.h and tinytest_macros.h, and the
+ * groups that you make here can go in the same tables as your C tests.
+ *
+ * Unless you define TT_EXIT_TEST_FUNCTION yourself, or include
+ * tinytest_macros.h first, failing checks in C++ test functions "return"
+ * instead of doing "goto end".
+ */
+
+#ifndef TINYTEST_HPP_INCLUDED_
+#define TINYTEST_HPP_INCLUDED_
+
+#ifndef TT_EXIT_TEST_FUNCTION
+#define TT_EXIT_TEST_FUNCTION TT_STMT_BEGIN return; TT_STMT_END
+#endif
+
+#include "tinytest.h"
+#include "tinytest_macros.h"
+
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <list>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace tinytest {
+
+namespace detail {
+
+/** True iff a T can be written to an ostream. */
+template <class T, class = void>
+struct is_streamable : std::false_type {};
+template <class T>
+struct is_streamable<T, decltype(void(std::declval<std::ostream &>() <<
+    std::declval<const T &>()))> : std::true_type {};
+
+} /* namespace detail */
+
+/** Formats values of type T for failure messages.  Specialize this for
+ * your own types if the defaults (operator<< when there is one, and a hex
+ * dump otherwise) don't suit you. */
+template <class T, class Enable = void>
+struct formatter {
+	static std::string format(const T &value) {
+		char *hex = tinytest_format_hex_(&value, sizeof(value));
+		std::string result = "<" + std::to_string(sizeof(value)) +
+		    "-byte object " + hex + ">";
+		std::free(hex);
+		return result;
+	}
+};
+
+template <class T>
+struct formatter<T, typename std::enable_if<
+    !std::is_enum<T>::value && detail::is_streamable<T>::value>::type> {
+	static std::string format(const T &value) {
+		std::ostringstream out;
+		out << value;
+		return out.str();
+	}
+};
+
+/* Enums are shown as their underlying integer, even when that's a char. */
+template <class T>
+struct formatter<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+	static std::string format(const T &value) {
+		typedef typename std::underlying_type<T>::type U;
+		typedef decltype(+U()) P;
+		return formatter<P>::format(static_cast<P>(value));
+	}
+};
+
+/* Small integers are shown as numbers, not as characters. */
+template <>
+struct formatter<signed char> {
+	static std::string format(signed char value) {
+		return formatter<int>::format(value);
+	}
+};
+template <>
+struct formatter<unsigned char> {
+	static std::string format(unsigned char value) {
+		return formatter<int>::format(value);
+	}
+};
+
+template <>
+struct formatter<bool> {
+	static std::string format(bool value) {
+		return value ? "true" : "false";
+	}
+};
+
+/* Strings are shown the same way that tt_str_op() shows them. */
+template <>
+struct formatter<const char *> {
+	static std::string format(const char *value) {
+		return value ? std::string("<") + value + ">" : "<NULL>";
+	}
+};
+template <>
+struct formatter<char *> : formatter<const char *> {};
+template <>
+struct formatter<std::string> {
+	static std::string format(const std::string &value) {
+		return "<" + value + ">";
+	}
+};
+
+template <>
+struct formatter<std::nullptr_t> {
+	static std::string format(std::nullptr_t) { return "nullptr"; }
+};
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef __int128 tt_int128_;
+__extension__ typedef unsigned __int128 tt_uint128_;
+
+template <>
+struct formatter<tt_uint128_> {
+	static std::string format(tt_uint128_ value) {
+		char buf[41], *cp = buf + sizeof(buf) - 1;
+		*cp = '\0';
+		do {
+			*--cp = (char)('0' + (int)(value % 10));
+			value /= 10;
+		} while (value);
+		return cp;
+	}
+};
+template <>
+struct formatter<tt_int128_> {
+	static std::string format(tt_int128_ value) {
+		tt_uint128_ magnitude = value < 0 ?
+		    -(tt_uint128_)value : (tt_uint128_)value;
+		return (value < 0 ? "-" : "") +
+		    formatter<tt_uint128_>::format(magnitude);
+	}
+};
+#endif
+
+/** Return a string describing value, for use in a failure message. */
+template <class T>
+std::string
+format_value(const T &value)
+{
+	return formatter<typename std::decay<T>::type>::format(value);
+}
+
+/** A group of tests, made at run time.  You can pass the result of cases()
+ * or entry() anywhere that tinytest wants a testcase_t array or a
+ * testgroup_t.  Don't add more cases after calling either one. */
+class group {
+public:
+	explicit group(const char *prefix) : prefix_(prefix) {}
+
+	/** Add a test that's an ordinary tinytest function. */
+	group &add(const char *name, testcase_fn fn, unsigned long flags = 0,
+	    const struct testcase_setup_t *setup = NULL,
+	    void *setup_data = NULL) {
+		struct testcase_t tc = { name, fn, flags, setup, setup_data };
+		cases_.push_back(tc);
+		return *this;
+	}
+
+	/** Add a test that's any callable taking no arguments, like a
+	 * lambda with captures. */
+	group &add(const char *name, std::function<void()> fn,
+	    unsigned long flags = 0) {
+		fns_.push_back(fn);
+		return add(name, run_function, flags, function_setup(),
+		    &fns_.back());
+	}
+
+	/** Return this group's cases, ending with END_OF_TESTCASES. */
+	struct testcase_t *cases() {
+		struct testcase_t end = END_OF_TESTCASES;
+		if (cases_.empty() || cases_.back().name)
+			cases_.push_back(end);
+		return &cases_[0];
+	}
+
+	/** Return an entry for this group to put in a testgroup_t table. */
+	struct testgroup_t entry() {
+		struct testgroup_t g = { prefix_, cases() };
+		return g;
+	}
+
+private:
+	static void *setup_function(const struct testcase_t *tc) {
+		return tc->setup_data;
+	}
+	static int cleanup_function(const struct testcase_t *, void *) {
+		return 1;
+	}
+	static const struct testcase_setup_t *function_setup() {
+		static const struct testcase_setup_t setup = {
+			setup_function, cleanup_function
+		};
+		return &setup;
+	}
+	static void run_function(void *fn) {
+		try {
+			(*static_cast<std::function<void()> *>(fn))();
+		} catch (const std::exception &e) {
+			tt_fail_printf(("uncaught exception: %s", e.what()));
+		} catch (...) {
+			tt_fail_msg("uncaught exception");
+		}
+	}
+
+	const char *prefix_;
+	std::vector<struct testcase_t> cases_;
+	std::list<std::function<void()> > fns_;
+};
+
+/** A table of groups to pass to tinytest_main().  It can hold both
+ * tinytest::groups and ordinary C testgroup_t tables. */
+class suite {
+public:
+	suite &add(group &g) {
+		groups_.push_back(g.entry());
+		return *this;
+	}
+	suite &add(const struct testgroup_t *groups) {
+		for (; groups->prefix; ++groups)
+			groups_.push_back(*groups);
+		return *this;
+	}
+	struct testgroup_t *groups() {
+		struct testgroup_t end = END_OF_GROUPS;
+		if (groups_.empty() || groups_.back().prefix)
+			groups_.push_back(end);
+		return &groups_[0];
+	}
+	int main(int argc, const char **argv) {
+		return tinytest_main(argc, argv, groups());
+	}
+private:
+	std::vector<struct testgroup_t> groups_;
+};
+
+} /* namespace tinytest */
+
+/* Helper: check that a op b, comparing a and b as their own types, and
+ * format them with tinytest::format_value() if the check fails. */
+#define tt_cxx_op_(a,op,b,die_on_fail)					\
+	TT_STMT_BEGIN							\
+	auto &&tt_val1_ = (a);						\
+	auto &&tt_val2_ = (b);						\
+	const bool tt_status_ = static_cast<bool>(tt_val1_ op tt_val2_); \
+	if (!tt_status_) {						\
+		char *tt_msg_ = tinytest_format_("assert(%s): %s vs %s", \
+		    #a" "#op" "#b,					\
+		    ::tinytest::format_value(tt_val1_).c_str(),		\
+		    ::tinytest::format_value(tt_val2_).c_str());	\
+		TT_DECLARE("FAIL", ("%s", tt_msg_ ? tt_msg_ : ""));	\
+		tinytest_record_failure_(__FILE__, __LINE__, tt_msg_);	\
+		tinytest_set_test_failed_();				\
+		die_on_fail ;						\
+	} else if (tinytest_verbosity_>1) {				\
+		TT_DECLARE("	 OK", ("assert(%s): %s vs %s",		\
+		    #a" "#op" "#b,					\
+		    ::tinytest::format_value(tt_val1_).c_str(),		\
+		    ::tinytest::format_value(tt_val2_).c_str()));	\
+	}								\
+	TT_STMT_END
+
+/* Check that a op b, and stop the test if it isn't so. */
+#define tt_op(a,op,b) tt_cxx_op_(a,op,b,TT_EXIT_TEST_FUNCTION)
+/* Check that a op b, but don't stop the test if it isn't so. */
+#define tt_want_op(a,op,b) tt_cxx_op_(a,op,b,(void)0)
+
+#endif
@@ -0,0 +1,275 @@
+/* tinytest_bench.c -- Copyright 2009-2012 Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* tinytest_bench measures what tinytest itself costs: it makes up suites of
+ * trivial tests, from a thousand up to a million of them, and times
+ * selecting them, running them in-process and forked, and checking
+ * assertions that pass and fail.
+ *
+ * Usage: tt-bench [MAX_CASES]
+ *
+ * The results go to stdout, one line per measurement, as tab-separated
+ * "benchmark cases ops seconds ns_per_op" after a header line.  Everything
+ * that the tests themselves print goes to /dev/null.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "tinytest.h"
+#include "tinytest_macros.h"
+
+/** Most tests to run forked, since each one costs a fork and a wait. */
+#define MAX_FORKED_CASES 10000
+/** Tests in each generated group. */
+#define CASES_PER_GROUP 1000
+/** Space for each generated test or group name. */
+#define NAME_LEN 24
+/** Names in the alias used to time alias selection. */
+#define N_ALIAS_NAMES 100
+
+/** Where the results go, since stdout goes to /dev/null. */
+static FILE *results;
+
+/** How many checks test_asserts does. */
+static long n_checks = 0;
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, long cases, long ops, double elapsed)
+{
+	fprintf(results, "%s\t%ld\t%ld\t%.6f\t%.1f\n", name, cases, ops,
+	    elapsed, ops ? elapsed * 1e9 / ops : 0.0);
+	fflush(results);
+}
+
+static void
+test_nothing(void *arg)
+{
+	(void)arg;
+}
+
+static void
+test_asserts(void *arg)
+{
+	long i;
+	(void)arg;
+	for (i = 0; i < n_checks; ++i)
+		tt_int_op(i, >=, 0);
+ end:
+	;
+}
+
+static void
+test_failures(void *arg)
+{
+	long i;
+	(void)arg;
+	for (i = 0; i < n_checks; ++i)
+		tt_want_int_op(i, <, 0);
+}
+
+/** Return a NULL-terminated array of groups holding n_cases tests that
+ * call fn, with flags. */
+static struct testgroup_t *
+make_groups(long n_cases, void (*fn)(void *), unsigned long flags)
+{
+	long n_groups = (n_cases + CASES_PER_GROUP - 1) / CASES_PER_GROUP;
+	struct testgroup_t *groups;
+	struct testcase_t *cases;
+	char *names, *prefixes;
+	long i;
+
+	groups = calloc(n_groups+1, sizeof(struct testgroup_t));
+	cases = calloc(n_groups*(CASES_PER_GROUP+1),
+	    sizeof(struct testcase_t));
+	names = malloc(n_cases * NAME_LEN);
+	prefixes = malloc(n_groups * NAME_LEN);
+	if (!groups || !cases || !names || !prefixes) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < n_groups; ++i) {
+		snprintf(prefixes + i*NAME_LEN, NAME_LEN, "g%ld/", i);
+		groups[i].prefix = prefixes + i*NAME_LEN;
+		groups[i].cases = cases + i*(CASES_PER_GROUP+1);
+	}
+	for (i = 0; i < n_cases; ++i) {
+		struct testcase_t *tc =
+		    &groups[i/CASES_PER_GROUP].cases[i%CASES_PER_GROUP];
+		snprintf(names + i*NAME_LEN, NAME_LEN, "t%ld",
+		    i % CASES_PER_GROUP);
+		tc->name = names + i*NAME_LEN;
+		tc->fn = fn;
+		tc->flags = flags;
+	}
+	return groups;
+}
+
+static void
+free_groups(struct testgroup_t *groups)
+{
+	free((char *)groups[0].prefix);
+	free((char *)groups[0].cases[0].name);
+	free(groups[0].cases);
+	free(groups);
+}
+
+/** Forget which tests earlier runs enabled, so that we can run again. */
+static void
+clear_selection(struct testgroup_t *groups)
+{
+	tinytest_set_flag_(groups, "..", 0, TT_ENABLED_|TT_SKIP);
+}
+
+/** Run tinytest_main on groups with the arguments in args, and return how
+ * long it took. */
+static double
+run_main(struct testgroup_t *groups, int n_args, const char **args)
+{
+	const char *argv[8];
+	double start;
+	int i;
+
+	argv[0] = "tt-bench";
+	for (i = 0; i < n_args; ++i)
+		argv[i+1] = args[i];
+	clear_selection(groups);
+	start = now();
+	(void) tinytest_main(n_args+1, argv, groups);
+	return now() - start;
+}
+
+/** Time selecting tests out of a suite of n_cases. */
+static void
+bench_selection(long n_cases)
+{
+	struct testgroup_t *groups = make_groups(n_cases, test_nothing, 0);
+	struct testlist_alias_t aliases[2];
+	const char *alias_names[N_ALIAS_NAMES+1];
+	const char *args[1];
+	char last[32], *names;
+	double start, elapsed;
+	long i;
+
+	start = now();
+	tinytest_set_flag_(groups, "..", 1, TT_ENABLED_);
+	report("select_all", n_cases, n_cases, now() - start);
+
+	snprintf(last, sizeof(last), "g%ld/t%ld", (n_cases-1)/CASES_PER_GROUP,
+	    (n_cases-1)%CASES_PER_GROUP);
+	start = now();
+	tinytest_set_flag_(groups, last, 1, TT_SKIP);
+	report("select_one", n_cases, n_cases, now() - start);
+
+	/* An alias of N_ALIAS_NAMES tests, spread over the suite.  We time
+	 * tinytest_main running them, since that's the only way to resolve
+	 * an alias; the 100 trivial tests cost next to nothing. */
+	if (!(names = malloc(N_ALIAS_NAMES * 32))) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < N_ALIAS_NAMES; ++i) {
+		long k = i * (n_cases / N_ALIAS_NAMES);
+		snprintf(names + i*32, 32, "g%ld/t%ld", k / CASES_PER_GROUP,
+		    k % CASES_PER_GROUP);
+		alias_names[i] = names + i*32;
+	}
+	alias_names[N_ALIAS_NAMES] = NULL;
+	aliases[0].name = "SOME";
+	aliases[0].tests = alias_names;
+	aliases[1].name = NULL;
+	aliases[1].tests = NULL;
+	tinytest_set_aliases(aliases);
+	args[0] = "@SOME";
+	elapsed = run_main(groups, 1, args);
+	report("select_alias", n_cases, N_ALIAS_NAMES, elapsed);
+	tinytest_set_aliases(NULL);
+
+	free(names);
+	free_groups(groups);
+}
+
+/** Time running n_cases tests that do nothing, with flags. */
+static void
+bench_dispatch(const char *name, long n_cases, unsigned long flags)
+{
+	struct testgroup_t *groups = make_groups(n_cases, test_nothing, flags);
+	report(name, n_cases, n_cases, run_main(groups, 0, NULL));
+	free_groups(groups);
+}
+
+/** Time one test that makes n checks with fn. */
+static void
+bench_checks(const char *name, long n, void (*fn)(void *))
+{
+	struct testgroup_t *groups = make_groups(1, fn, 0);
+	n_checks = n;
+	report(name, 1, n, run_main(groups, 0, NULL));
+	n_checks = 0;
+	free_groups(groups);
+}
+
+int
+main(int c, const char **v)
+{
+	long max_cases = 1000000, n;
+	int devnull, out;
+
+	if (c > 1 && (max_cases = atol(v[1])) < 1) {
+		printf("Usage: %s [MAX_CASES]\n", v[0]);
+		return 1;
+	}
+
+	if ((out = dup(1)) < 0 || !(results = fdopen(out, "w")) ||
+	    (devnull = open("/dev/null", O_WRONLY)) < 0 ||
+	    dup2(devnull, 1) < 0) {
+		perror("Can't redirect stdout");
+		return 1;
+	}
+	close(devnull);
+
+	fprintf(results, "benchmark\tcases\tops\tseconds\tns_per_op\n");
+	for (n = 1000; n <= max_cases; n *= 10) {
+		bench_selection(n);
+		bench_dispatch("dispatch", n, 0);
+		if (n <= MAX_FORKED_CASES)
+			bench_dispatch("dispatch_forked", n, TT_FORK);
+		bench_checks("assert_pass", n, test_asserts);
+		bench_checks("assert_fail", n, test_failures);
+	}
+	return 0;
+}
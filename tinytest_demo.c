@@ -41,6 +41,7 @@
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <pthread.h>
 #endif
 
 /* ============================================================ */
@@ -111,7 +112,7 @@ struct data_buffer {
 void *
 setup_data_buffer(const struct testcase_t *testcase)
 {
-	struct data_buffer *db = malloc(sizeof(struct data_buffer));
+	struct data_buffer *db = calloc(1, sizeof(struct data_buffer));
 
 	/* If you had a complicated set of setup rules, you might behave
 	   differently here depending on testcase->flags or
@@ -186,6 +187,10 @@ test_timeout(void *ptr)
 #endif
 	t2 = time(NULL);
 
+	/* You can record numbers and strings about a test; they show up
+	 * when you run with --verbose. */
+	tt_record_metric("seconds", t2-t1);
+
 	tt_int_op(t2-t1, >=, 4);
 
 	tt_int_op(t2-t1, <=, 6);
@@ -194,6 +199,212 @@ test_timeout(void *ptr)
 	;
 }
 
+/* Code under test can count the work it does, so that tests can check that
+ * it isn't doing too much. */
+static int
+find_char(const char *s, char c)
+{
+	int i;
+	for (i = 0; s[i]; ++i) {
+		tt_counter_add("comparisons", 1);
+		if (s[i] == c)
+			return i;
+	}
+	return -1;
+}
+
+void
+test_counters(void *ptr)
+{
+	(void)ptr;
+	tt_int_op(find_char("tinytest", 'y'), ==, 3);
+	/* Finding the fourth character should take four comparisons. */
+	tt_counter_le("comparisons", 4);
+ end:
+	;
+}
+
+/* tt_alloc() gives a test memory that ends right where an inaccessible
+ * page begins, so that writing even one byte past the end crashes the
+ * test at once, instead of quietly overwriting something else. */
+void
+test_alloc(void *ptr)
+{
+	char *name;
+	(void)ptr;
+	name = tt_alloc(sizeof("tinytest"));
+	tt_assert(name);
+	/* This fills the buffer exactly.  With one byte less, it would
+	 * crash. */
+	strcpy(name, "tinytest");
+	tt_str_op(name, ==, "tinytest");
+	/* There's no need to free memory from tt_alloc(): it all goes away
+	 * before the next test.  But you can, and then touching it
+	 * crashes the test too. */
+	tt_free(name);
+ end:
+	;
+}
+
+/* A test can check a whole block of output against a "golden" file that
+ * holds what the output should be.  If it doesn't match, the test fails
+ * with a diff.  When you change the output on purpose, run the test with
+ * --update-golden to rewrite the file. */
+void
+test_golden(void *ptr)
+{
+	char buf[256];
+	int i, n = 0;
+	(void)ptr;
+	for (i = 1; i <= 5; ++i)
+		n += snprintf(buf+n, sizeof(buf)-n, "%d squared is %d\n", i,
+		    i*i);
+	tt_file_eq_golden("tinytest_demo.golden", buf, n);
+ end:
+	;
+}
+
+#ifndef _WIN32
+/* When a setup function needs something that takes a long time to build,
+ * it can build it once, into a fixture image that every test then maps.
+ * The image is rebuilt only when its key, or one of its input files,
+ * changes.  This one is just a table of squares. */
+static int
+build_squares(const char *path, void *arg)
+{
+	FILE *f = fopen(path, "wb");
+	unsigned i, square;
+	(void)arg;
+	if (!f)
+		return -1;
+	for (i = 0; i < 1000; ++i) {
+		square = i*i;
+		fwrite(&square, sizeof(square), 1, f);
+	}
+	return fclose(f) ? -1 : 0;
+}
+
+struct squares {
+	const unsigned *table;
+	unsigned long len;
+};
+
+void *
+setup_squares(const struct testcase_t *testcase)
+{
+	struct squares *sq = calloc(1, sizeof(struct squares));
+	(void)testcase;
+	if (!sq)
+		return NULL;
+	/* There are no input files: only the key says which version of
+	 * the table this is. */
+	sq->table = tinytest_fixture_map("squares", "v1", NULL, build_squares,
+	    NULL, &sq->len);
+	if (!sq->table) {
+		free(sq);
+		return NULL;
+	}
+	return sq;
+}
+
+int
+clean_squares(const struct testcase_t *testcase, void *ptr)
+{
+	struct squares *sq = ptr;
+	(void)testcase;
+	tinytest_fixture_unmap(sq->table, sq->len);
+	free(sq);
+	return 1;
+}
+
+struct testcase_setup_t squares_setup = { setup_squares, clean_squares };
+
+void
+test_fixture(void *ptr)
+{
+	struct squares *sq = ptr;
+	tt_int_op(sq->len, ==, 1000 * sizeof(unsigned));
+	tt_int_op(sq->table[12], ==, 144);
+ end:
+	;
+}
+
+/* To test code that several threads use at once, write a function that
+ * does the work on one thread and returns how many operations it did.
+ * tt_run_threads() runs it on several threads, all starting together. */
+struct shared_count {
+	pthread_mutex_t lock;
+	long n;
+};
+
+static unsigned long
+count_up(void *arg, int idx)
+{
+	struct shared_count *sc = arg;
+	unsigned long i;
+	(void)idx; /* Which thread this is, from 0 up. */
+	for (i = 0; i < 10000; ++i) {
+		pthread_mutex_lock(&sc->lock);
+		++sc->n;
+		pthread_mutex_unlock(&sc->lock);
+	}
+	return i;
+}
+
+void
+test_threads(void *ptr)
+{
+	struct shared_count sc = { PTHREAD_MUTEX_INITIALIZER, 0 };
+	(void)ptr;
+	tt_int_op(tt_run_threads(4, count_up, &sc), ==, 40000);
+	/* The lock kept any increments from getting lost. */
+	tt_int_op(sc.n, ==, 40000);
+ end:
+	;
+}
+
+/* A test can wait for a file descriptor or a timer without blocking.  This
+ * one sets a timer that writes to a pipe, and then waits to read from the
+ * pipe.  Tinytest runs other tests while it waits. */
+static int async_pipe[2] = { -1, -1 };
+
+static void
+async_readable(struct tinytest_async_t *a, int fd, void *arg)
+{
+	char c = 0;
+	(void)arg;
+	tt_int_op(read(fd, &c, 1), ==, 1);
+	tt_int_op(c, ==, 'x');
+ end:
+	close(async_pipe[0]);
+	close(async_pipe[1]);
+	tt_async_done(a);
+}
+
+static void
+async_timer_fired(struct tinytest_async_t *a, int fd, void *arg)
+{
+	(void)fd; (void)arg;
+	tt_int_op(write(async_pipe[1], "x", 1), ==, 1);
+ end:
+	;
+}
+
+void
+test_async(void *ptr)
+{
+	struct tinytest_async_t *a;
+	(void)ptr;
+	tt_int_op(pipe(async_pipe), ==, 0);
+	a = tt_async_begin(5000);
+	tt_assert(a);
+	tt_async_timer(a, 10, async_timer_fired, NULL);
+	tt_async_watch(a, async_pipe[0], TT_ASYNC_READ, async_readable, NULL);
+ end:
+	;
+}
+#endif
+
 /* ============================================================ */
 
 /* Now we need to make sure that our tests get invoked.	  First, you take
@@ -214,6 +425,33 @@ struct testcase_t demo_tests[] = {
 	 * can enable it manually by passing +demo/timeout at the command line.*/
 	{ "timeout", test_timeout, TT_OFF_BY_DEFAULT },
 
+	/* The same test, with its sleep() and time() calls replaced by a
+	 * virtual clock.  If you build tinytest.c with
+	 * TINYTEST_INTERPOSE_TIME, it runs instantly. */
+	{ "timeout_virtual", test_timeout, TT_VIRTUAL_TIME|TT_OFF_BY_DEFAULT },
+
+	/* This test checks how much work its code did. */
+	{ "counters", test_counters, },
+
+	/* This test uses memory from tt_alloc().  It runs in a subprocess,
+	 * so that if it does crash, the other tests keep going. */
+	{ "alloc", test_alloc, TT_FORK },
+
+	/* This test compares its output with tinytest_demo.golden. */
+	{ "golden", test_golden, },
+
+#ifndef _WIN32
+	/* This test reads a table that its setup function maps from a
+	 * fixture image. */
+	{ "fixture", test_fixture, TT_FORK, &squares_setup },
+
+	/* This test runs its code on four threads at once. */
+	{ "threads", test_threads, },
+
+	/* This test finishes from its callbacks, after it returns. */
+	{ "async", test_async, },
+#endif
+
 	/* The array has to end with END_OF_TESTCASES. */
 	END_OF_TESTCASES
 };
@@ -240,12 +478,18 @@ struct testlist_alias_t aliases[] = {
 	END_OF_ALIASES
 };
 
+/* If you build this file as a shared module, tinytest_runner can load it
+ * and run its tests along with other modules' tests.  These are the
+ * symbols that it looks for. */
+struct testgroup_t *tinytest_module_groups = groups;
+struct testlist_alias_t *tinytest_module_aliases = aliases;
+
 
 int
 main(int c, const char **v)
 {
-	/* Finally, just call tinytest_main().	It lets you specify verbose
-	   or quiet output with --verbose and --quiet.	You can list
+	/* Finally, just call tinytest_main().  It lets you specify verbose
+	   or quiet output with --verbose and --quiet.  You can list
 	   specific tests:
 
 	       tinytest-demo demo/memcpy
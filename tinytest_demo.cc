@@ -0,0 +1,112 @@
+/* tinytest_demo.cc -- Copyright 2009-2012 Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* The C++ version of the example file: the same kind of tests, written
+ * with tinytest.hpp. */
+
+#include "tinytest.hpp"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+/* ============================================================ */
+
+/* An ordinary test function works just as it does in C, except that a
+ * failed check returns instead of jumping to "end". */
+static void
+test_strings(void *data)
+{
+	(void)data;
+	std::string s = "hello";
+
+	/* tt_op() compares std::strings as std::strings... */
+	tt_op(s + " world", ==, "hello world");
+	tt_op(s.size(), ==, 5u);
+	/* ...and you can still use the C checks when they fit. */
+	tt_str_op(s.c_str(), ==, "hello");
+	tt_want_op(s.find('l'), <, s.find('o'));
+}
+
+enum color { RED, GREEN, BLUE };
+
+/* A type with no operator<<, to show the hex-dump formatter. */
+struct point {
+	int x, y;
+	bool operator==(const point &o) const { return x == o.x && y == o.y; }
+};
+
+static void
+test_types(void *data)
+{
+	(void)data;
+	point a = { 1, 2 }, b = { 1, 2 };
+
+	tt_op(GREEN, ==, 1);
+	tt_op(a, ==, b);
+	tt_op(static_cast<signed char>(-1), <, 0);
+	tt_op(sizeof(long long), >=, 8u);
+}
+
+/* ============================================================ */
+
+/* A table of C-style tests, to show that they mix with the others. */
+static struct testcase_t string_tests[] = {
+	{ "strings", test_strings, 0, NULL, NULL },
+	{ "types", test_types, TT_FORK, NULL, NULL },
+	END_OF_TESTCASES
+};
+
+static struct testgroup_t c_groups[] = {
+	{ "c/", string_tests },
+	END_OF_GROUPS
+};
+
+int
+main(int c, const char **v)
+{
+	std::vector<int> numbers;
+	for (int i = 0; i < 10; ++i)
+		numbers.push_back(i * i);
+
+	/* Lambdas can capture whatever they test. */
+	tinytest::group lambdas("lambda/");
+	lambdas.add("capture", [&numbers]() {
+		tt_op(numbers.size(), ==, 10u);
+		tt_op(numbers[3], ==, 9);
+	});
+	lambdas.add("forked", [&numbers]() {
+		numbers.clear();
+		tt_op(numbers.empty(), ==, true);
+	}, TT_FORK);
+	lambdas.add("still_there", [&numbers]() {
+		/* The forked test cleared only its own copy. */
+		tt_op(numbers.size(), ==, 10u);
+	});
+
+	tinytest::suite suite;
+	suite.add(lambdas).add(c_groups);
+	return suite.main(c, v);
+}
@@ -36,17 +36,24 @@
 #define TT_EXIT_TEST_FUNCTION TT_STMT_BEGIN goto end; TT_STMT_END
 #endif
 
-/* Redefine this if you want to note success/failure in some different way. */
+/* Redefine this if you want to note success/failure in some different way.
+ * The default formats the whole message first, and prints it with a single
+ * write, so that messages from different threads don't interleave. */
 #ifndef TT_DECLARE
 #define TT_DECLARE(prefix, args)				\
 	TT_STMT_BEGIN						\
-	printf("\n  %s %s:%d: ",prefix,__FILE__,__LINE__);	\
-	printf args ;						\
+	tinytest_declare_(prefix,__FILE__,__LINE__,tinytest_format_ args); \
 	TT_STMT_END
 #endif
 
-/* Announce a failure. Args are parenthesized printf args. */
-#define TT_GRIPE(args) TT_DECLARE("FAIL", args)
+/* Announce a failure, and record it for the current test. Args are
+ * parenthesized printf args, which we format only once. */
+#define TT_GRIPE(args)						\
+	TT_STMT_BEGIN						\
+	char *tt_gripe_msg_ = tinytest_format_ args;		\
+	TT_DECLARE("FAIL", ("%s", tt_gripe_msg_ ? tt_gripe_msg_ : "")); \
+	tinytest_record_failure_(__FILE__, __LINE__, tt_gripe_msg_); \
+	TT_STMT_END
 
 /* Announce a non-failure if we're verbose. */
 #define TT_BLATHER(args)						\
@@ -79,6 +86,105 @@
 #define tt_fail_msg(msg) TT_FAIL(("%s", msg))
 #define tt_fail() TT_FAIL(("%s", "(Failed.)"))
 
+/* Record a named number, or a key and a string value, for the current test.
+ * These reach the main process even from a forked test, and are shown
+ * with --verbose. */
+#define tt_record_metric(name, value)				\
+	tinytest_record_metric_((name), (double)(value))
+#define tt_record_value(key, value)				\
+	tinytest_record_value_((key), (value))
+
+/* Add delta to the counter called name.  Code under test can use this to
+ * count the work it does -- cache misses, rehashes, syscalls -- so that
+ * tests can check it with tt_counter_op().  Counters start at zero for
+ * each test, and every counter that isn't zero at the end is recorded as
+ * a "counter.NAME" metric.  Each call site looks its counter up once, so
+ * name has to be the same string every time that line runs. */
+#define tt_counter_add(name, delta)					\
+	TT_STMT_BEGIN							\
+	static int tt_counter_id_ = -1;					\
+	if (tt_counter_id_ < 0)						\
+		tt_counter_id_ = tinytest_counter_id_(name);		\
+	tinytest_counter_add_(tt_counter_id_, (long)(delta));		\
+	TT_STMT_END
+#define tt_counter_get(name) tinytest_counter_get_(name)
+
+/* Run fn(arg, i) on n threads for i in 0..n-1, releasing them all at
+ * once, and wait for them to finish.  Each fn returns how many operations
+ * it did; the total comes back, and the counts and the total rate are
+ * recorded as metrics.  Checks that fail in fn fail the current test. */
+#define tt_run_threads(n, fn, arg)				\
+	tinytest_run_threads_((n), (fn), (arg), 0)
+/* As tt_run_threads(), but bind each thread to its own CPU. */
+#define tt_run_threads_pinned(n, fn, arg)			\
+	tinytest_run_threads_((n), (fn), (arg), 1)
+
+/* Helper: check a golden file, and fail with the diff if it doesn't match.
+ * expr can use tt_golden_path_, and sets tt_golden_diff_. */
+#define tt_golden_check_(path, expr, fail)				\
+	TT_STMT_BEGIN							\
+	const char *tt_golden_path_ = (path);				\
+	char *tt_golden_diff_ = NULL;					\
+	if ((expr) > 0) {						\
+		TT_BLATHER(("output matches %s", tt_golden_path_));	\
+	} else {							\
+		tinytest_set_test_failed_();				\
+		TT_GRIPE(("%s", tt_golden_diff_ ? tt_golden_diff_ :	\
+			"(Failed.)"));					\
+		free(tt_golden_diff_);					\
+		fail;							\
+	}								\
+	TT_STMT_END
+
+/* Check that the len bytes at buf are the same as the contents of the
+ * golden file at path, and fail with a diff of the first differences if
+ * they aren't.  With --update-golden, rewrite the golden file instead. */
+#define tt_file_eq_golden(path, buf, len)				\
+	tt_golden_check_(path, tinytest_file_eq_golden_(tt_golden_path_, \
+		(buf), (len), &tt_golden_diff_), TT_EXIT_TEST_FUNCTION)
+#define tt_want_file_eq_golden(path, buf, len)				\
+	tt_golden_check_(path, tinytest_file_eq_golden_(tt_golden_path_, \
+		(buf), (len), &tt_golden_diff_), (void)0)
+/* As tt_file_eq_golden, for the contents of the file at actual_path. */
+#define tt_files_eq_golden(path, actual_path)				\
+	tt_golden_check_(path, tinytest_files_eq_golden_(tt_golden_path_, \
+		(actual_path), &tt_golden_diff_), TT_EXIT_TEST_FUNCTION)
+#define tt_want_files_eq_golden(path, actual_path)			\
+	tt_golden_check_(path, tinytest_files_eq_golden_(tt_golden_path_, \
+		(actual_path), &tt_golden_diff_), (void)0)
+
+/* In a TT_VIRTUAL_TIME test, move the clocks forward by msec
+ * milliseconds, without waiting. */
+#define tt_advance_time(msec) tinytest_advance_time_(msec)
+
+/* Allocate n zeroed bytes for the current test, placed so that touching
+ * the byte after them crashes the test.  Returns NULL if the arena is out
+ * of space, or the process is out of memory mappings, which on Linux
+ * happens after about 32,000 live allocations.  Everything allocated this
+ * way goes away when the next test starts, so there is no need to free
+ * it; but after tt_free(), touching the memory crashes the test too.
+ * Allocations are only as aligned as their size is: an array of structs
+ * is fine; a 3-byte string isn't aligned at all. */
+#define tt_alloc(n) tinytest_alloc_(n)
+#define tt_free(p) tinytest_free_(p)
+
+/* Make the current test asynchronous: once its function returns, tinytest
+ * keeps it going by calling the callbacks it registered with
+ * tt_async_watch() and tt_async_timer(), until one of them calls
+ * tt_async_done().  The test fails if that hasn't happened within
+ * timeout_msec.  Returns the state to pass to the other tt_async calls. */
+#define tt_async_begin(timeout_msec)				\
+	tinytest_async_begin_(__FILE__, __LINE__, (timeout_msec))
+/* Call cb(a, fd, arg) once fd is ready for TT_ASYNC_READ, TT_ASYNC_WRITE,
+ * or both. */
+#define tt_async_watch(a, fd, what, cb, arg)			\
+	tinytest_async_watch_((a), (fd), (what), (cb), (arg))
+/* Call cb(a, -1, arg) once msec milliseconds have passed. */
+#define tt_async_timer(a, msec, cb, arg)			\
+	tinytest_async_timer_((a), (msec), (cb), (arg))
+/* Finish an async test. */
+#define tt_async_done(a) tinytest_async_done_(a)
+
 /* End the current test, and indicate we are skipping it. */
 #define tt_skip()						\
 	TT_STMT_BEGIN						\
@@ -120,15 +226,21 @@
 		printf_type print_;					\
 		printf_type print1_;					\
 		printf_type print2_;					\
+		char *tt_msg_;						\
 		type value_ = val1_;					\
 		setup_block;						\
 		print1_ = print_;					\
 		value_ = val2_;						\
 		setup_block;						\
 		print2_ = print_;					\
+		tt_msg_ = tinytest_format_("assert(%s): " printf_fmt	\
+		    " vs " printf_fmt, str_test, print1_, print2_);	\
 		TT_DECLARE(tt_status_?"	 OK":"FAIL",			\
-			   ("assert(%s): " printf_fmt " vs " printf_fmt,\
-			    str_test, print1_, print2_));		\
+			   ("%s", tt_msg_ ? tt_msg_ : ""));		\
+		if (!tt_status_)					\
+			tinytest_record_failure_(__FILE__, __LINE__, tt_msg_); \
+		else							\
+			free(tt_msg_);					\
 		print_ = print1_;					\
 		cleanup_block;						\
 		print_ = print2_;					\
@@ -181,6 +293,13 @@
 			  TT_EXIT_TEST_FUNCTION				\
                           );
 
+/* Fail unless the counter called name, op, n. */
+#define tt_counter_op(name,op,n)					\
+	tt_assert_test_type(tinytest_counter_get_(name),n,		\
+	    "counter("#name") "#op" "#n,long,(val1_ op val2_),"%ld",	\
+	    TT_EXIT_TEST_FUNCTION)
+#define tt_counter_le(name,n) tt_counter_op(name,<=,n)
+
 #define tt_want_int_op(a,op,b)						\
 	tt_assert_test_type(a,b,#a" "#op" "#b,long,(val1_ op val2_),"%ld",(void)0)
 
@@ -188,6 +307,10 @@
 	tt_assert_test_type(a,b,#a" "#op" "#b,unsigned long,		\
 	    (val1_ op val2_),"%lu",(void)0)
 
+#define tt_want_counter_op(name,op,n)					\
+	tt_assert_test_type(tinytest_counter_get_(name),n,		\
+	    "counter("#name") "#op" "#n,long,(val1_ op val2_),"%ld",(void)0)
+
 #define tt_want_ptr_op(a,op,b)						\
   tt_assert_test_type(a,b,#a" "#op" "#b,const void*,			\
 	    (val1_ op val2_),"%p",(void)0)
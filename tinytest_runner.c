@@ -0,0 +1,204 @@
+/* tinytest_runner.c -- Copyright 2009-2012 Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* tinytest_runner loads test modules -- shared objects that export the
+ * symbols named by TT_MODULE_GROUPS_SYMBOL and (optionally)
+ * TT_MODULE_ALIASES_SYMBOL -- and runs all of their tests from a single
+ * process, as if they had been linked into one program.  Every group and
+ * alias in a module gets the module's name as a prefix, so that the tests
+ * in "foo.so" are called "foo/<prefix><name>".
+ *
+ * Usage: tinytest_runner --load=MODULE.so [--load=...] [tinytest options]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "tinytest.h"
+
+/** Return a newly allocated string holding a, then b, then c. */
+static char *
+concat3(const char *a, const char *b, const char *c)
+{
+	size_t len = strlen(a) + strlen(b) + strlen(c) + 1;
+	char *result = malloc(len);
+	if (!result) {
+		perror("malloc");
+		exit(1);
+	}
+	snprintf(result, len, "%s%s%s", a, b, c);
+	return result;
+}
+
+/** Return the name to use as a prefix for the module at path: its
+ * basename, up to the first '.', followed by a slash. */
+static char *
+module_prefix(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	char *result, *dot;
+	base = base ? base+1 : path;
+	result = concat3(base, "/", "");
+	if ((dot = strchr(result, '.'))) {
+		dot[0] = '/';
+		dot[1] = '\0';
+	}
+	return result;
+}
+
+/** Return a copy of the alias entry 'test' from a module, adjusted to
+ * refer to names with the module prefix 'mod'. */
+static const char *
+prefix_alias_entry(const char *mod, const char *test)
+{
+	size_t n = strspn(test, "@:+");
+	char *modifiers = concat3(test, "", "");
+	char *result;
+	modifiers[n] = '\0';
+	result = concat3(modifiers, mod, test+n);
+	free(modifiers);
+	return result;
+}
+
+static struct testgroup_t *all_groups = NULL;
+static int n_groups = 0;
+static struct testlist_alias_t *all_aliases = NULL;
+static int n_aliases = 0;
+
+/** Load the test module at path, and add its groups and aliases to
+ * all_groups and all_aliases.  Return 0 on success, -1 on failure. */
+static int
+load_module(const char *path)
+{
+	void *handle;
+	struct testgroup_t **groupsp;
+	struct testlist_alias_t **aliasesp;
+	struct testgroup_t *groups;
+	const struct testlist_alias_t *aliases = NULL;
+	char *mod;
+	int i, j, n;
+
+	if (!(handle = dlopen(path, RTLD_NOW|RTLD_LOCAL))) {
+		printf("Couldn't load %s: %s\n", path, dlerror());
+		return -1;
+	}
+	groupsp = (struct testgroup_t **) dlsym(handle,
+	    TT_MODULE_GROUPS_SYMBOL);
+	if (!groupsp || !*groupsp) {
+		printf("%s has no %s.\n", path, TT_MODULE_GROUPS_SYMBOL);
+		return -1;
+	}
+	groups = *groupsp;
+	aliasesp = (struct testlist_alias_t **) dlsym(handle,
+	    TT_MODULE_ALIASES_SYMBOL);
+	if (aliasesp)
+		aliases = *aliasesp;
+
+	mod = module_prefix(path);
+	for (i = 0; i < n_groups; ++i) {
+		if (!strncmp(all_groups[i].prefix, mod, strlen(mod))) {
+			printf("%s would name its tests %s*, like a module "
+			    "loaded before it.\n", path, mod);
+			return -1;
+		}
+	}
+
+	for (n = 0; groups[n].prefix; ++n)
+		;
+	all_groups = realloc(all_groups,
+	    (n_groups+n+1) * sizeof(struct testgroup_t));
+	if (!all_groups) {
+		perror("realloc");
+		exit(1);
+	}
+	for (i = 0; i < n; ++i) {
+		all_groups[n_groups].prefix = concat3(mod, groups[i].prefix,
+		    "");
+		all_groups[n_groups].cases = groups[i].cases;
+		++n_groups;
+	}
+	all_groups[n_groups].prefix = NULL;
+	all_groups[n_groups].cases = NULL;
+
+	for (n = 0; aliases && aliases[n].name; ++n)
+		;
+	all_aliases = realloc(all_aliases,
+	    (n_aliases+n+1) * sizeof(struct testlist_alias_t));
+	if (!all_aliases) {
+		perror("realloc");
+		exit(1);
+	}
+	for (i = 0; i < n; ++i) {
+		const char **tests;
+		int n_tests;
+		for (n_tests = 0; aliases[i].tests[n_tests]; ++n_tests)
+			;
+		if (!(tests = calloc(n_tests+1, sizeof(const char *)))) {
+			perror("calloc");
+			exit(1);
+		}
+		for (j = 0; j < n_tests; ++j)
+			tests[j] = prefix_alias_entry(mod, aliases[i].tests[j]);
+		all_aliases[n_aliases].name = concat3(mod, aliases[i].name, "");
+		all_aliases[n_aliases].tests = tests;
+		++n_aliases;
+	}
+	all_aliases[n_aliases].name = NULL;
+	all_aliases[n_aliases].tests = NULL;
+
+	free(mod);
+	return 0;
+}
+
+int
+main(int c, const char **v)
+{
+	const char **args;
+	int i, n_args = 1;
+
+	if (!(args = calloc(c+1, sizeof(const char *)))) {
+		perror("calloc");
+		return 1;
+	}
+	args[0] = v[0];
+	for (i = 1; i < c; ++i) {
+		if (!strncmp(v[i], "--load=", 7)) {
+			if (load_module(v[i]+7) < 0)
+				return 1;
+		} else {
+			args[n_args++] = v[i];
+		}
+	}
+	if (!all_groups) {
+		printf("Usage: %s --load=MODULE.so [--load=...] [options]\n",
+		    v[0]);
+		return 1;
+	}
+
+	tinytest_set_aliases(all_aliases);
+	return tinytest_main(n_args, args, all_groups);
+}